@@ -8,119 +8,159 @@
 
 #include	"dat.h"
 #include	"fns.h"
+#ifdef PLAN9PORT
+#include	<poll.h>
+#endif
 
 enum
 {
-	Maxfdata	= 128*1024,
+	Maxfdata	= 128*1024,	/* until Tversion says otherwise */
+	Maxmsize	= 8*1024*1024,	/* largest message size we'll agree to */
+	Nworker	= 4,	/* default number of worker procs */
+	Stack	= 32*1024,
+
+	Ntaghash	= 64,	/* must be power of 2 */
+	Minfids	= 64,	/* initial fid table size; must be power of 2 */
+
+	Ibufsize	= 8*1024,	/* a connection's read buffer, for the starts of messages */
+	Nreqper	= 4,	/* Reqs in the pool per worker */
+	Poolbytes	= 64*1024*1024,	/* Req buffers, at most, before readers wait */
+	Keepbuf	= 64*1024,	/* larger buffers are freed when their Req is idle */
+
+	Outbufsize	= 32*1024,	/* small replies gathered for one write */
+	Maxbatched	= 8*1024,	/* larger replies are written directly */
+};
+
+typedef struct Ibuf Ibuf;
+struct Ibuf {
+	uchar*	buf;
+	uchar*	rp;	/* next unparsed byte */
+	uchar*	wp;	/* end of data read */
+	uchar*	ep;
 };
 
+typedef struct Conn Conn;
 typedef struct Req Req;
+
+/*
+ * a client connection: the #s pipe or an accepted network call.
+ * each has its own fids, tags and message size, and a proc to read it,
+ * except that under plan9port one proc polls all the network calls;
+ * the worker procs, which also write the replies, and the Reqs are shared by all of them.
+ */
+struct Conn {
+	int	fd;
+	int	issrv;	/* the posted pipe: the server ends with it */
+	int	hungup;
+	uint	msize;	/* negotiated by Tversion */
+	Ibuf	in;
+	Req*	part;	/* message being read, once its size is known */
+	uint	have;	/* bytes of it read */
+#ifdef PLAN9PORT
+	int	polled;	/* served by the poller */
+	int	closing;	/* reading has ended; freed once its requests finish */
+	Conn*	pnext;	/* in the poller's list */
+	Req*	version;	/* Tversion waiting for the requests before it to finish */
+#endif
+	QLock	busylk;
+	Rendez	done;	/* a request has finished */
+	int	nbusy;	/* requests read and not yet finished */
+	QLock	wlk;	/* held by the worker writing replies */
+	Lock	outlock;
+	Req*	outq;	/* replies waiting to be written */
+	Req**	outtail;
+	Lock	taglock;
+	Req*	tags[Ntaghash];	/* requests in progress */
+	Lock	fidlock;
+	Fid**	fids;	/* open addressing, linear probing */
+	uint	nfids;	/* size of fids, a power of 2 */
+	uint	nused;
+};
+
 struct Req {
-	uchar	data[IOHDRSZ+Maxfdata];	/* should allocate */
+	Conn*	c;
+	Req*	next;	/* in the pool, or c->outq */
+	uchar*	data;	/* size bytes, allocated by reqgrow */
+	uint	size;
+	uchar*	out;	/* start of reply in data */
 	uchar*	statbuf;
 	usize	statsize;
 	int	n;
 	Fcall	t;
 	Fcall	r;
+	Fid*	fid;	/* found by findfid, locked until reply */
 	ulong	pid;
+	uchar*	obuf;	/* the worker's, to gather replies */
+
+	int	flushed;	/* a Tflush named this request */
+	Req*	flushq;	/* Tflush requests waiting for this one */
+	Req*	tnext;	/* in tag table, and flushq */
+	vlong	start;	/* when read, for latency */
+	u64int	path;	/* of the fid's file, for tracing */
 };
 
-int	messagesize = IOHDRSZ+Maxfdata;
+static Conn*	newconn(int, int);
+static void	freeconn(Conn*);
+static void	connproc(void*);
+static void	listener(void*);
+static void worker(void*);
+static void	serve(Req*, uchar*);
+static void	abortall(Conn*);
+static void	version(Conn*, Req*);
+static Req*	getreq(Conn*, uint);
+static void	putreq(Req*);
+static void	reqgrow(Req*, uint);
+static int	readmore(Conn*);
+static Req*	nextreq(Conn*, int*);
+static Req*	readreq(Conn*);
+static void	flushout(Conn*, uchar*);
+static void reply(Req*);
+static void replyerr(Req*, char*);
+static Fid* findfid(Req*, u32int);
+static void	putreqfid(Req*);
+static Fid*	newfid(Conn*, u32int, String*);
+static void	clunkfid(Conn*, Fid*);
+static void	clunkall(Conn*);
+static void	addtag(Req*);
+static void	untag(Req*);
+static int	rflush(Req*);
+static void	finish(Req*, char*);
 
-static void server(int);
-static int readreq(int, Req*);
-static void reply(int, Req*);
-static void replyerr(int, Req*, char*);
-static Fid* findfid(u32int);
-static Fid*	newfid(u32int, String*);
-static void	clunkfid(Fid*);
+static int	nworker = Nworker;
+static Channel*	reqq;	/* requests waiting for a worker, from all connections */
 
-char*	mountpoint = "/n/kfs";
-char*	logname;	/* TO DO: pair */
-char*	diskname;
-char*	srvfile = "#s/nubfs";
-int	exiting;
+/*
+ * Reqs and their message buffers are shared by all connections,
+ * so that many mostly idle clients cost little:
+ * a buffer is only as big as the largest message it has held,
+ * and readers wait when too many Reqs, or too much buffer, are in use.
+ */
+static struct {
+	QLock;
+	Rendez	free;
+	Req*	idle;
+	int	nreq;	/* allocated */
+	int	busy;	/* out of the pool */
+	uvlong	bytes;	/* in all Req buffers */
+} pool;
 
-static void
-usage(void)
-{
-	fprint(2, "usage: %s [-Ddebug] [-s srvname] datafile logfile\n", argv0);
-	exits("usage");
-}
+#ifdef PLAN9PORT
+/*
+ * plan9port has poll, so one proc reads all network connections,
+ * instead of a proc each; the #s pipe keeps its own.
+ */
+static void	poller(void*);
+static void	pollwake(void);
 
-void
-main(int argc, char **argv)
-{
-	int dfd, lfd, srvfd, pip[2];
-	char *p;
-	Dir *d;
-	LogFile *lf;
-
-	ARGBEGIN{
-	case 'D':
-		p = ARGF();
-		if(p != nil && *p){
-			for(; *p; p++)
-				debug[*p&0xFF] = 1;
-		}
-		break;
-	case 's':
-		srvfile = smprint("#s/%s", EARGF(usage()));
-		break;
-	default:
-		usage();
-	}ARGEND
-
-	if(argc != 2)
-		usage();
-	diskname = argv[0];
-	logname = argv[1];
-
-	quotefmtinstall();
-	fmtinstall('F', fcallfmt);
-	fmtinstall('D', dirfmt);
-	fmtinstall('M', dirmodefmt);
-
-	lfd = open(logname, ORDWR);
-	if(lfd < 0)
-		error("can't open %s: %r", logname);
-	d = dirfstat(lfd);
-	if(d == nil)
-		error("can't fstat %s: %r", logname);
-	lf = logopen(lfd, d->length);
-	free(d);
-
-	dfd = open(diskname, ORDWR);
-	if(dfd < 0)
-		error("can't open %s: %r", diskname);
-	d = dirfstat(dfd);
-	if(d == nil)
-		error("can't fstat %s: %r", diskname);
-	
-	nubinit(lf, diskinit(dfd, 1024, 0, d->length), getuser());
-	free(d);
-
-	if(debug['R'] == 0)
-		nubreplay();
-
-	if(pipe(pip) < 0)
-		error("can't pipe: %r");
-	srvfd = create(srvfile, OWRITE|ORCLOSE, 0666);
-	if(srvfd < 0)
-		error("can't create %s: %r", srvfile);
-	fprint(srvfd, "%d", pip[1]);
-	close(pip[1]);
-	switch(rfork(RFFDG|RFPROC|RFNAMEG|RFNOTEG)){
-	case 0:
-		server(pip[0]);
-		exits(nil);
-	case -1:
-		error("can't fork: %r");
-		break;
-	default:
-		exits(nil);
-	}
-}
+static struct {
+	Lock;
+	Conn*	new;	/* from the listeners, not yet polled */
+	int	wake[2];	/* a byte written to wake[1] interrupts poll */
+	int	started;
+} polls;
+#endif
+
+int	exiting;
 
 static void rversion(Req*);
 static void rauth(Req*);
@@ -156,101 +196,744 @@ srvexits(char *e)
 {
 	fprint(2, "server ends: flush\n");
 	nubflush();
-	exits(e);
+	threadexitsall(e);
+}
+
+/*
+ * start nproc worker procs, or the default number if 0
+ */
+void
+srvinit(int nproc)
+{
+	int i;
+
+	if(nproc > 0)
+		nworker = nproc;
+	reqq = chancreate(sizeof(Req*), 2*nworker);
+	pool.free.l = &pool;
+	for(i = 0; i < nworker; i++)
+		if(proccreate(worker, nil, Stack) < 0)
+			error("can't create worker: %r");
+}
+
+/*
+ * serve calls to addr
+ */
+void
+srvlisten(char *addr)
+{
+#ifdef PLAN9PORT
+	if(!polls.started){
+		if(pipe(polls.wake) < 0)
+			error("can't pipe: %r");
+		fcntl(polls.wake[1], F_SETFL, O_NONBLOCK);
+		if(proccreate(poller, nil, Stack) < 0)
+			error("can't create poller: %r");
+		polls.started = 1;
+	}
+#endif
+	if(proccreate(listener, addr, Stack) < 0)
+		error("can't create listener: %r");
+}
+
+/*
+ * serve 9P on fd; the server ends with it if issrv (the posted pipe)
+ */
+void
+srvconn(int fd, int issrv)
+{
+	Conn *c;
+
+	c = newconn(fd, issrv);
+	if(issrv){
+		if(procrfork(connproc, c, Stack, RFFDG|RFNAMEG|RFNOTEG) < 0)
+			error("can't fork: %r");
+	}else if(proccreate(connproc, c, Stack) < 0){
+		freeconn(c);
+		error("can't serve: %r");
+	}
+}
+
+/*
+ * accept calls on an announced address; each becomes a connection
+ */
+static void
+listener(void *a)
+{
+	char *addr, adir[40], ldir[40];
+	int lcfd, fd;
+	Conn *c;
+
+	addr = a;
+	threadsetname("nubfs listen %s", addr);
+	if(announce(addr, adir) < 0)
+		error("can't announce %s: %r", addr);
+	for(;;){
+		lcfd = listen(adir, ldir);
+		if(lcfd < 0)
+			error("listen %s: %r", addr);
+		fd = accept(lcfd, ldir);
+		close(lcfd);
+		if(fd < 0){
+			fprint(2, "nubfs: accept %s: %r\n", addr);
+			continue;
+		}
+		c = newconn(fd, 0);
+#ifdef PLAN9PORT
+		c->polled = 1;
+		lock(&polls);
+		c->pnext = polls.new;
+		polls.new = c;
+		unlock(&polls);
+		pollwake();
+#else
+		if(proccreate(connproc, c, Stack) < 0){
+			fprint(2, "nubfs: can't serve %s: %r\n", ldir);
+			freeconn(c);
+		}
+#endif
+	}
+}
+
+static Conn*
+newconn(int fd, int issrv)
+{
+	Conn *c;
+
+	c = emallocz(sizeof(*c), 1);
+	c->fd = fd;
+	c->issrv = issrv;
+	c->msize = IOHDRSZ+Maxfdata;
+	c->in.buf = emallocz(Ibufsize, 0);
+	c->in.rp = c->in.wp = c->in.buf;
+	c->in.ep = c->in.buf+Ibufsize;
+	c->done.l = &c->busylk;
+	c->outtail = &c->outq;
+	return c;
+}
+
+/*
+ * close the connection and free it
+ */
+static void
+freeconn(Conn *c)
+{
+	close(c->fd);
+	if(c->part != nil)
+		putreq(c->part);
+#ifdef PLAN9PORT
+	if(c->version != nil)
+		putreq(c->version);
+#endif
+	free(c->in.buf);
+	free(c);
+}
+
+/*
+ * read requests on a connection and pass them to the pool of worker procs,
+ * so that one slow request doesn't hold up the others.
+ * requests on the same fid are serialised by the fid's lock.
+ * one client can't have more than its share of the Reqs in progress.
+ * Tversion is answered here, once those before it are done,
+ * so none overlaps the reset or sees the old message size.
+ */
+static void
+connproc(void *a)
+{
+	Conn *c;
+	Req *r;
+
+	c = a;
+	threadsetname("nubfs conn %d", c->fd);
+	if(c->issrv)
+		rfork(RFCNAMEG);
+	for(;;){
+		qlock(&c->busylk);
+		while(c->nbusy >= 2*nworker)
+			rsleep(&c->done);
+		qunlock(&c->busylk);
+		if(exiting || c->hungup)
+			break;
+		r = readreq(c);
+		if(r == nil)
+			break;
+		if(r->t.type == Tversion){
+			abortall(c);
+			qlock(&c->busylk);
+			while(c->nbusy > 0)
+				rsleep(&c->done);
+			qunlock(&c->busylk);
+			version(c, r);
+			continue;
+		}
+		qlock(&c->busylk);
+		c->nbusy++;
+		qunlock(&c->busylk);
+		addtag(r);
+		sendp(reqq, r);
+	}
+	/* wait for the workers to finish what they have */
+	qlock(&c->busylk);
+	while(c->nbusy > 0)
+		rsleep(&c->done);
+	qunlock(&c->busylk);
+	if(c->issrv || exiting)
+		srvexits(nil);
+	clunkall(c);
+	freeconn(c);
+	threadexits(nil);
 }
 
+/*
+ * n requests on c have been answered; c might be freed once this returns
+ */
+static void
+reqdone(Conn *c, int n)
+{
+#ifdef PLAN9PORT
+	int wake;
+
+	qlock(&c->busylk);
+	wake = c->polled && (c->nbusy >= 2*nworker || c->nbusy == n);
+	c->nbusy -= n;
+	rwakeup(&c->done);
+	qunlock(&c->busylk);
+	if(wake)
+		pollwake();	/* to poll c again, or free it */
+#else
+	qlock(&c->busylk);
+	c->nbusy -= n;
+	rwakeup(&c->done);
+	qunlock(&c->busylk);
+#endif
+}
+
+/*
+ * mark c's requests in progress flushed, so that long ones give up early
+ */
+static void
+abortall(Conn *c)
+{
+	Req *r;
+	int i;
+
+	lock(&c->taglock);
+	for(i = 0; i < Ntaghash; i++)
+		for(r = c->tags[i]; r != nil; r = r->tnext)
+			r->flushed = 1;
+	unlock(&c->taglock);
+}
+
+/*
+ * answer Tversion r on c, which has no other requests in progress,
+ * in the reading proc
+ */
+static void
+version(Conn *c, Req *r)
+{
+	uchar *obuf;
+
+	obuf = emallocz(Outbufsize, 0);
+	qlock(&c->busylk);
+	c->nbusy++;
+	qunlock(&c->busylk);
+	addtag(r);
+	serve(r, obuf);
+	free(obuf);
+}
+
+#ifdef PLAN9PORT
+static void
+pollwake(void)
+{
+	write(polls.wake[1], "", 1);	/* non-blocking: if the pipe is full, poll will return anyway */
+}
+
+/*
+ * pass on the complete requests read from c, stopping at a Tversion
+ * until those before it have finished
+ */
+static void
+pollreqs(Conn *c)
+{
+	Req *r;
+	int bad;
+
+	bad = 0;
+	while((r = nextreq(c, &bad)) != nil){
+		if(r->t.type == Tversion){
+			abortall(c);
+			c->version = r;
+			return;
+		}
+		qlock(&c->busylk);
+		c->nbusy++;
+		qunlock(&c->busylk);
+		addtag(r);
+		sendp(reqq, r);
+	}
+	if(bad || c->hungup)
+		c->closing = 1;
+}
+
+/*
+ * connections whose reading has ended are freed once their
+ * requests are answered. those with their share of requests
+ * in progress, or a Tversion waiting, aren't polled until some finish.
+ */
 static void
-server(int fd)
+poller(void*)
 {
+	Conn *conns, *c, **l;
+	Conn **pc;
+	struct pollfd *pfd;
+	int npfd, n, i, idle, room;
+	char buf[64];
 	Req *r;
+
+	threadsetname("nubfs poll");
+	conns = nil;
+	pfd = nil;
+	pc = nil;
+	npfd = 0;
+	for(;;){
+		if(exiting)
+			srvexits(nil);
+		lock(&polls);
+		while((c = polls.new) != nil){
+			polls.new = c->pnext;
+			c->pnext = conns;
+			conns = c;
+		}
+		unlock(&polls);
+		n = 1;
+		for(c = conns; c != nil; c = c->pnext)
+			n++;
+		if(n > npfd){
+			npfd = 2*n;
+			free(pfd);
+			free(pc);
+			pfd = emallocz(npfd*sizeof(*pfd), 0);
+			pc = emallocz(npfd*sizeof(*pc), 0);
+		}
+		pfd[0].fd = polls.wake[0];
+		pfd[0].events = POLLIN;
+		n = 1;
+		for(l = &conns; (c = *l) != nil;){
+			qlock(&c->busylk);
+			idle = c->nbusy == 0;
+			room = c->nbusy < 2*nworker;
+			qunlock(&c->busylk);
+			if(c->closing && idle){
+				*l = c->pnext;
+				clunkall(c);
+				freeconn(c);
+				continue;
+			}
+			l = &c->pnext;
+			if(c->version != nil && idle && !c->closing){
+				r = c->version;
+				c->version = nil;
+				version(c, r);
+				pollreqs(c);	/* those read after it */
+			}
+			if(c->closing || c->version != nil || !room)
+				continue;
+			pfd[n].fd = c->fd;
+			pfd[n].events = POLLIN;
+			pc[n] = c;
+			n++;
+		}
+		if(poll(pfd, n, -1) < 0){
+			fprint(2, "nubfs: poll: %r\n");
+			continue;
+		}
+		if(pfd[0].revents)
+			read(polls.wake[0], buf, sizeof(buf));
+		for(i = 1; i < n; i++){
+			if(pfd[i].revents == 0)
+				continue;
+			c = pc[i];
+			if(!readmore(c)){
+				c->closing = 1;
+				continue;
+			}
+			pollreqs(c);
+		}
+	}
+}
+#endif
+
+static void
+worker(void*)
+{
+	Req *r;
+	uchar *obuf;
+
+	threadsetname("nubfs worker");
+	obuf = emallocz(Outbufsize, 0);
+	for(;;){
+		r = recvp(reqq);
+		serve(r, obuf);
+	}
+}
+
+/*
+ * answer r, gathering replies in obuf
+ */
+static void
+serve(Req *r, uchar *obuf)
+{
 	void (*op)(Req*);
 	char err[ERRMAX];
 
-	rfork(RFCNAMEG);
-	atexit(nubflush);
-	r = emallocz(sizeof(*r), 1);
 	r->pid = getpid();
-	while(!exiting && readreq(fd, r) > 0){
-		if(debug['9'])
-			fprint(2, "nubfs: %lud: <-%F\n", r->pid, &r->t);
-		if(r->t.type >= nelem(fcalls) || (op = fcalls[r->t.type]) == nil){
-			replyerr(fd, r, "invalid 9p operation");
-			break;
+	r->obuf = obuf;
+	getctx()->flushed = &r->flushed;
+	if(debug['9'])
+		fprint(2, "nubfs: %lud: <-%F\n", r->pid, &r->t);
+	if(r->t.type == Tflush){
+		/* once queued behind the old request, r can be answered and reused at any time */
+		if(!rflush(r))
+			finish(r, nil);
+	}else if(r->t.type >= nelem(fcalls) || (op = fcalls[r->t.type]) == nil){
+		r->c->hungup = 1;	/* drop the connection */
+		finish(r, "invalid 9p operation");
+	}else if(waserror()){
+		rerrstr(err, sizeof(err));
+		putreqfid(r);
+		finish(r, err);
+	}else{
+		(*op)(r);
+		putreqfid(r);
+		finish(r, nil);
+		poperror();
+	}
+	getctx()->flushed = nil;
+}
+
+static void
+connwrite(Conn *c, uchar *buf, int n)
+{
+	if(c->hungup || n == 0)
+		return;
+	if(write(c->fd, buf, n) != n){
+		if(c->issrv)
+			error("mount write");
+		c->hungup = 1;
+	}
+}
+
+/*
+ * write the replies queued on c, unless another worker is already at it,
+ * in which case that one will write them too.
+ * replies that are ready together are gathered in buf for a single write;
+ * large ones (typically Rread) go out on their own.
+ */
+static void
+flushout(Conn *c, uchar *buf)
+{
+	Req *r, *q;
+	int n;
+
+	for(;;){
+		lock(&c->outlock);
+		if(c->outq == nil || !canqlock(&c->wlk)){
+			unlock(&c->outlock);
+			return;
 		}
-		if(waserror()){
-			rerrstr(err, sizeof(err));
-			replyerr(fd, r, err);
-		}else{
-			(*op)(r);
-			reply(fd, r);
-			poperror();
+		q = c->outq;
+		c->outq = nil;
+		c->outtail = &c->outq;
+		unlock(&c->outlock);
+		n = 0;
+		while((r = q) != nil){
+			q = r->next;
+			if(n+r->n > Outbufsize || r->n > Maxbatched){
+				connwrite(c, buf, n);
+				n = 0;
+			}
+			if(r->n > Maxbatched)
+				connwrite(c, r->out, r->n);
+			else{
+				memmove(buf+n, r->out, r->n);
+				n += r->n;
+			}
+			putreq(r);
 		}
+		connwrite(c, buf, n);
+		qunlock(&c->wlk);
 	}
-	srvexits(nil);
 }
 
-static int
-readreq(int fd, Req *r)
+/*
+ * a Req from the pool for a message of size bytes on c
+ */
+static Req*
+getreq(Conn *c, uint size)
+{
+	Req *r;
+
+	qlock(&pool);
+	while(pool.idle == nil && pool.nreq >= Nreqper*nworker ||
+	    pool.busy > 0 && pool.bytes+size > Poolbytes)
+		rsleep(&pool.free);
+	if((r = pool.idle) != nil)
+		pool.idle = r->next;
+	else{
+		r = emallocz(sizeof(*r), 1);
+		pool.nreq++;
+	}
+	pool.busy++;
+	qunlock(&pool);
+	r->c = c;
+	reqgrow(r, size);
+	return r;
+}
+
+static void
+putreq(Req *r)
+{
+	uchar *b;
+
+	b = nil;
+	qlock(&pool);
+	if(r->size > Keepbuf){
+		pool.bytes -= r->size;
+		b = r->data;
+		r->data = nil;
+		r->size = 0;
+	}
+	r->next = pool.idle;
+	pool.idle = r;
+	pool.busy--;
+	rwakeup(&pool.free);
+	qunlock(&pool);
+	free(b);
+}
+
+/*
+ * give r a buffer of at least size bytes, losing what it held.
+ * workers grow buffers without waiting, so that requests
+ * already admitted always finish.
+ */
+static void
+reqgrow(Req *r, uint size)
+{
+	if(r->size >= size)
+		return;
+	qlock(&pool);
+	pool.bytes += size-r->size;
+	qunlock(&pool);
+	free(r->data);
+	r->data = emallocz(size, 0);
+	r->size = size;
+}
+
+static void
+readerr(Conn *c)
 {
 	char buf[ERRMAX];
 
-	r->n = read9pmsg(fd, r->data, messagesize);
-	if(r->n > 0){
-		if(convM2S(r->data, r->n, &r->t) == 0)
-			error("bad message format");
-		return r->n;
+	rerrstr(buf, sizeof(buf));
+	if(buf[0]=='\0' || strstr(buf, "hungup") || !c->issrv)
+		return;
+	error("mount read");
+}
+
+/*
+ * a malformed message ends a network connection, but the server on the pipe
+ */
+static void
+badmsg(Conn *c, char *why)
+{
+	if(c->issrv)
+		error("%s", why);
+	fprint(2, "nubfs: connection %d: %s\n", c->fd, why);
+}
+
+/*
+ * one read from the connection: as much as the channel will give
+ * into the connection's buffer, which might be several small requests
+ * on a stream, or, once a large message's size is known, the rest of it
+ * straight into its Req's buffer, so that Twrite data is not copied
+ * on its way to the disk. 0 when the conversation ends.
+ */
+static int
+readmore(Conn *c)
+{
+	Ibuf *in;
+	long n;
+
+	if(c->part != nil){
+		n = read(c->fd, c->part->data+c->have, c->part->n-c->have);
+		if(n > 0)
+			c->have += n;
+	}else{
+		in = &c->in;
+		n = in->wp-in->rp;
+		memmove(in->buf, in->rp, n);
+		in->rp = in->buf;
+		in->wp = in->buf+n;
+		n = read(c->fd, in->wp, in->ep-in->wp);
+		if(n > 0)
+			in->wp += n;
 	}
-	if(r->n < 0){
-		rerrstr(buf, sizeof(buf));
-		if(buf[0]=='\0' || strstr(buf, "hungup"))
-			return 0;
-		error("mount read");
+	if(n <= 0){
+		if(n < 0)
+			readerr(c);
+		return 0;
 	}
-	return 0;
+	return 1;
 }
 
+/*
+ * the next complete request in what has been read, if any;
+ * a message gets a Req from the pool once its size is known.
+ * *bad is set if the conversation must end.
+ */
+static Req*
+nextreq(Conn *c, int *bad)
+{
+	Ibuf *in;
+	Req *r;
+	uint size, n;
+
+	in = &c->in;
+	if(c->part == nil){
+		if(in->wp-in->rp < BIT32SZ)
+			return nil;
+		size = GBIT32(in->rp);
+		if(size < BIT32SZ+BIT8SZ+BIT16SZ || size > c->msize){
+			badmsg(c, "bad message size");
+			*bad = 1;
+			return nil;
+		}
+		r = getreq(c, size);
+		n = in->wp-in->rp;
+		if(n > size)
+			n = size;
+		memmove(r->data, in->rp, n);
+		in->rp += n;
+		r->n = size;
+		c->part = r;
+		c->have = n;
+	}
+	r = c->part;
+	if(c->have < r->n)
+		return nil;
+	c->part = nil;
+	if(convM2S(r->data, r->n, &r->t) == 0){
+		putreq(r);
+		badmsg(c, "bad message format");
+		*bad = 1;
+		return nil;
+	}
+	return r;
+}
+
+/*
+ * the next request, reading as needed; a pipe keeps message
+ * boundaries, so there we get at most one per read.
+ * nil when the conversation ends.
+ */
+static Req*
+readreq(Conn *c)
+{
+	Req *r;
+	int bad;
+
+	bad = 0;
+	while((r = nextreq(c, &bad)) == nil)
+		if(bad || !readmore(c))
+			return nil;
+	return r;
+}
+
+/*
+ * rread leaves the data at IOHDRSZ in r->data,
+ * so the Rread header is put in front of it rather than
+ * having convS2M copy the data into place.
+ */
 static void
-reply(int fd, Req *r)
+packreply(Req *r)
 {
-	int n;
+	uchar *p;
 
-	r->r.tag = r->t.tag;
-	r->r.type = r->t.type+1;
 	if(debug['9'])
 		fprint(2, "nubfs %lud: ->%F\n", r->pid, &r->r);
-	n = convS2M(&r->r, r->data, messagesize);
-	if(n == 0)
+	if(r->r.type == Rread && (uchar*)r->r.data == r->data+IOHDRSZ){
+		p = r->data+IOHDRSZ-(BIT32SZ+BIT8SZ+BIT16SZ+BIT32SZ);
+		r->n = BIT32SZ+BIT8SZ+BIT16SZ+BIT32SZ+r->r.count;
+		PBIT32(p, r->n);
+		PBIT8(p+BIT32SZ, Rread);
+		PBIT16(p+BIT32SZ+BIT8SZ, r->r.tag);
+		PBIT32(p+BIT32SZ+BIT8SZ+BIT16SZ, r->r.count);
+		r->out = p;
+	}else{
+		reqgrow(r, sizeS2M(&r->r));
+		r->n = convS2M(&r->r, r->data, r->size);
+		r->out = r->data;
+	}
+	if(r->n == 0)
 		error("convS2M error on write");
-	if(write(fd, r->data, n) != n)
-		error("mount write");
 }
 
+/*
+ * the reply joins the connection's queue; finish writes it
+ */
 static void
-replyerr(int fd, Req *r, char *msg)
+queuereply(Req *r)
 {
-	int n;
+	Conn *c;
+
+	c = r->c;
+	r->next = nil;
+	lock(&c->outlock);
+	*c->outtail = r;
+	c->outtail = &r->next;
+	unlock(&c->outlock);
+}
 
+static void
+reply(Req *r)
+{
+	r->r.tag = r->t.tag;
+	r->r.type = r->t.type+1;
+	packreply(r);
+}
+
+static void
+replyerr(Req *r, char *msg)
+{
 	r->r.tag = r->t.tag;
 	r->r.type = Rerror;
 	r->r.ename = msg;
-	if(debug['9'])
-		fprint(2, "nubfs %lud: ->%F\n", r->pid, &r->r);
-	n = convS2M(&r->r, r->data, messagesize);
-	if(n == 0)
-		error("convS2M error on write");
-	if(write(fd, r->data, n) != n)
-		error("mount write");
+	packreply(r);
 }
 
+/*
+ * called by the connection's reader with nothing else in progress,
+ * so the fids can be reset and the size changed under no one's feet
+ */
 static void
 rversion(Req *r)
 {
+	char *v;
+
 	if(r->t.msize < 256)
 		raise("message size too small");
-	if(messagesize > r->t.msize)
-		messagesize = r->t.msize;
-	r->r.msize = messagesize;
+	r->c->msize = r->t.msize;
+	if(r->c->msize > Maxmsize)
+		r->c->msize = Maxmsize;
+	r->r.msize = r->c->msize;
+	v = r->t.version;
+	if(strncmp(v, VERSION9P, 6) != 0 || v[6] != 0 && v[6] != '.'){
+		r->r.version = "unknown";
+		return;
+	}
 	r->r.version = VERSION9P;
+	clunkall(r->c);
 }
 
 static void
@@ -259,10 +942,28 @@ rauth(Req*)
 	raise("authentication not required");	/* TO DO */
 }
 
-static void
-rflush(Req*)
+/*
+ * if the old request is still running, mark it flushed so that
+ * long operations give up early, and reply after its reply,
+ * in which case return 1.
+ */
+static int
+rflush(Req *r)
 {
-	/* "synchronous, so easy" */
+	Req *o;
+
+	lock(&r->c->taglock);
+	for(o = r->c->tags[r->t.oldtag&(Ntaghash-1)]; o != nil; o = o->tnext)
+		if(o->t.tag == r->t.oldtag && o != r)
+			break;
+	if(o != nil){
+		o->flushed = 1;
+		untag(r);
+		r->tnext = o->flushq;
+		o->flushq = r;
+	}
+	unlock(&r->c->taglock);
+	return o != nil;
 }
 
 static void
@@ -272,11 +973,11 @@ rattach(Req *r)
 
 	if(r->t.afid != NOFID)
 		raise(Eauth);
-	f = newfid(r->t.fid, string(r->t.uname));
+	f = newfid(r->c, r->t.fid, string(r->t.uname));
 	if(f == nil)
 		raise(Efidinuse);
 	if(waserror()){
-		clunkfid(f);
+		clunkfid(r->c, f);
 		raise(nil);
 	}
 	nubattach(f, r->t.uname, r->t.aname);
@@ -290,25 +991,25 @@ rwalk(Req *r)
 	Fid *f, *nf;
 	Walkqid *wq;
 
-	f = findfid(r->t.fid);
+	f = findfid(r, r->t.fid);
 	if(r->t.newfid != NOFID){
-		nf = newfid(r->t.newfid, f->user);
+		nf = newfid(r->c, r->t.newfid, f->user);
 		if(nf == nil)
 			raise(Efidinuse);
 	}else
 		nf = nil;
 	if(waserror()){
 		if(nf != nil)
-			clunkfid(nf);
+			clunkfid(r->c, nf);
 		raise(nil);
 	}
 	wq = nubwalk(f, nf, r->t.nwname, r->t.wname);
 	if(wq->nqid != r->t.nwname && nf != nil)
-		clunkfid(nf);
+		clunkfid(r->c, nf);
 	poperror();
 	r->r.nwqid = wq->nqid;
 	memmove(r->r.wqid, wq->qid, wq->nqid*sizeof(*wq->qid));
-	free(wq);
+	putwalkqid(wq);
 }
 
 static void
@@ -316,12 +1017,12 @@ ropen(Req *r)
 {
 	Fid *f;
 
-	f = findfid(r->t.fid);
+	f = findfid(r, r->t.fid);
 	if(f->open >= 0)
 		raise(Eopened);
 	nubopen(f, r->t.mode);
 	r->r.qid = f->entry->qid;
-	r->r.iounit = messagesize-IOHDRSZ;
+	r->r.iounit = nubiounit(f, r->c->msize-IOHDRSZ);
 }
 
 static void
@@ -329,12 +1030,12 @@ rcreate(Req *r)
 {
 	Fid *f;
 
-	f = findfid(r->t.fid);
+	f = findfid(r, r->t.fid);
 	if(f->open >= 0)
 		raise(Eopened);
 	nubcreate(f, r->t.name, r->t.mode, r->t.perm);
 	r->r.qid = f->entry->qid;
-	r->r.iounit = messagesize-IOHDRSZ;
+	r->r.iounit = nubiounit(f, r->c->msize-IOHDRSZ);
 }
 
 static void
@@ -343,10 +1044,11 @@ rread(Req *r)
 	Fid *f;
 	usize n;
 
-	f = findfid(r->t.fid);
+	f = findfid(r, r->t.fid);
 	n = r->t.count;
-	if(n > sizeof(r->data)-IOHDRSZ)
-		n = sizeof(r->data)-IOHDRSZ;
+	if(n > r->c->msize-IOHDRSZ)
+		n = r->c->msize-IOHDRSZ;
+	reqgrow(r, IOHDRSZ+n);	/* r->t's strings and data are gone */
 	r->r.count = nubread(f, r->data+IOHDRSZ, n, r->t.offset);
 	r->r.data = (char*)r->data+IOHDRSZ;
 }
@@ -357,9 +1059,9 @@ rwrite(Req *r)
 	Fid *f;
 	usize n;
 
-	f = findfid(r->t.fid);
+	f = findfid(r, r->t.fid);
 	n = r->t.count;
-	if(n > sizeof(r->data))
+	if(n > r->size)
 		raise(Ecount);	/* can't happen */
 	r->r.count = nubwrite(f, r->t.data, n, r->t.offset);
 }
@@ -369,9 +1071,9 @@ rclunk(Req *r)
 {
 	Fid *f;
 
-	f = findfid(r->t.fid);
+	f = findfid(r, r->t.fid);
 	nubclunk(f);
-	clunkfid(f);
+	clunkfid(r->c, f);
 }
 
 static void
@@ -379,34 +1081,30 @@ rremove(Req *r)
 {
 	Fid *f;
 
-	f = findfid(r->t.fid);
+	f = findfid(r, r->t.fid);
 	if(waserror()){
-		clunkfid(f);	/* remove(5) requires fid to be clunked even on error */
+		clunkfid(r->c, f);	/* remove(5) requires fid to be clunked even on error */
 		raise(nil);	/* propagate nubremove's error, though */
 	}
 	nubremove(f);
 	poperror();
-	clunkfid(f);
+	clunkfid(r->c, f);
 }
 
 static void
 rstat(Req *r)
 {
 	Fid *f;
-	Dir *d;
-	usize n;
+	uint n;
 
-	f = findfid(r->t.fid);
-	d = nubstat(f);
-	n = sizeD2M(d);
-	if(n > r->statsize){
+	f = findfid(r, r->t.fid);
+	while((n = nubstat(f, r->statbuf, r->statsize)) > r->statsize){
 		free(r->statbuf);
 		r->statbuf = emallocz(n, 0);
 		r->statsize = n;
 	}
-	r->r.nstat = convD2M(d, r->statbuf, r->statsize);
+	r->r.nstat = n;
 	r->r.stat = r->statbuf;
-	free(d);
 }
 
 static void
@@ -416,7 +1114,7 @@ rwstat(Req *r)
 	Dir d;
 	char *strs;
 
-	f = findfid(r->t.fid);
+	f = findfid(r, r->t.fid);
 	if(r->t.nstat > 32*1024)
 		raise(Estatsize);
 	strs = emallocz(r->t.nstat, 0);
@@ -432,59 +1130,260 @@ rwstat(Req *r)
 }
 
 /*
- * fid maps
+ * tags of requests in progress
  */
 
-enum{
-	FIDSIZE=127,
-};
+static void
+addtag(Req *r)
+{
+	Req **l;
+
+	r->flushed = 0;
+	r->flushq = nil;
+	r->start = nsec();
+	r->path = 0;
+	lock(&r->c->taglock);
+	l = &r->c->tags[r->t.tag&(Ntaghash-1)];
+	r->tnext = *l;
+	*l = r;
+	unlock(&r->c->taglock);
+}
+
+/* called with c->taglock held */
+static void
+untag(Req *r)
+{
+	Req **l;
+
+	for(l = &r->c->tags[r->t.tag&(Ntaghash-1)]; *l != nil; l = &(*l)->tnext)
+		if(*l == r){
+			*l = r->tnext;
+			break;
+		}
+}
+
+/* the fid a message names, for the trace */
+static u32int
+msgfid(Fcall *t)
+{
+	switch(t->type){
+	case Tversion:
+	case Tflush:
+		return NOFID;
+	case Tauth:
+		return t->afid;
+	}
+	return t->fid;
+}
+
+/*
+ * the tag is released as the reply is queued, since the client can then reuse it,
+ * and under the tag lock, so that a Tflush that finds it gone is answered after it.
+ * any Tflush waiting for r is answered after r's own reply.
+ * once queued, a reply might be written, and its Req reused, by another worker.
+ */
+static void
+finish(Req *r, char *err)
+{
+	Req *f, *fq;
+	Conn *c;
+	uchar *obuf;
+	vlong now;
+	int n;
+
+	c = r->c;
+	obuf = r->obuf;
+	now = nsec();
+	histadd(r->t.type, now-r->start);
+	trace(err != nil? Trerr: Trreq, r->t.type, r->t.tag, msgfid(&r->t), r->path,
+		r->t.type == Tread || r->t.type == Twrite? r->r.count: 0, now-r->start, 0);
+	if(err != nil)
+		replyerr(r, err);
+	else
+		reply(r);
+	lock(&c->taglock);
+	untag(r);
+	fq = r->flushq;
+	r->flushq = nil;
+	queuereply(r);
+	unlock(&c->taglock);
+	n = 1;
+	while((f = fq) != nil){
+		fq = f->tnext;
+		histadd(f->t.type, nsec()-f->start);
+		reply(f);
+		queuereply(f);
+		n++;
+	}
+	flushout(c, obuf);
+	reqdone(c, n);
+}
 
-static Fid	*fids[FIDSIZE];
+/*
+ * fid maps
+ */
 
-static Fid**
-hashfid(u32int fid)
+/*
+ * open-addressed table, kept at most half full, so that a client
+ * with many thousands of fids still finds each in a probe or two.
+ * called with c->fidlock held.
+ */
+static uint
+fidslot(Conn *c, u32int fid)
 {
-	Fid **hp, *f;
+	uint i, m;
+	Fid *f;
 
-	for(hp = &fids[fid&(FIDSIZE-1)]; (f = *hp) != nil; hp = &f->next)
+	m = c->nfids-1;
+	for(i = (fid*0x9E3779B1UL)&m; (f = c->fids[i]) != nil; i = (i+1)&m)
 		if(f->fid == fid)
 			break;
-	return hp;
+	return i;
+}
+
+static void
+fidgrow(Conn *c)
+{
+	Fid **ofids, *f;
+	uint i, onfids;
+
+	ofids = c->fids;
+	onfids = c->nfids;
+	c->nfids = onfids == 0? Minfids: 2*onfids;
+	c->fids = emallocz(c->nfids*sizeof(*c->fids), 1);
+	for(i = 0; i < onfids; i++)
+		if((f = ofids[i]) != nil)
+			c->fids[fidslot(c, f->fid)] = f;
+	free(ofids);
+}
+
+/*
+ * delete slot i, moving later members of its probe sequence back
+ * to fill the gap, so no tombstones are needed
+ */
+static void
+fiddel(Conn *c, uint i)
+{
+	uint j, h, m;
+	Fid *f;
+
+	m = c->nfids-1;
+	c->fids[i] = nil;
+	c->nused--;
+	for(j = (i+1)&m; (f = c->fids[j]) != nil; j = (j+1)&m){
+		h = (f->fid*0x9E3779B1UL)&m;
+		/* leave f alone if its home lies cyclically in (i, j] */
+		if(i <= j? (i < h && h <= j): (i < h || h <= j))
+			continue;
+		c->fids[i] = f;
+		c->fids[j] = nil;
+		i = j;
+	}
 }
 
 static Fid*
-findfid(u32int fid)
+lookfid(Conn *c, u32int fid)
+{
+	if(c->nfids == 0)
+		return nil;
+	return c->fids[fidslot(c, fid)];
+}
+
+/*
+ * the fid is held (referenced and locked) by r until putreqfid
+ */
+static Fid*
+findfid(Req *r, u32int fid)
 {
 	Fid *f;
 
-	f = *hashfid(fid);
+	lock(&r->c->fidlock);
+	f = lookfid(r->c, fid);
+	if(f != nil)
+		incref(f);
+	unlock(&r->c->fidlock);
 	if(f == nil)
 		raise(Ebadfid);
+	qlock(f);
+	r->fid = f;
 	return f;
 }
 
+static void
+putreqfid(Req *r)
+{
+	Fid *f;
+
+	f = r->fid;
+	if(f != nil){
+		r->fid = nil;
+		if(f->entry != nil)
+			r->path = f->entry->qid.path;
+		qunlock(f);
+		putfid(f);
+	}
+}
+
 static Fid*
-newfid(u32int fid, String *user)
+newfid(Conn *c, u32int fid, String *user)
 {
-	Fid *f, **hp;
+	Fid *f;
 
-	hp = hashfid(fid);
-	if(*hp != nil)
+	lock(&c->fidlock);
+	if(lookfid(c, fid) != nil){
+		unlock(&c->fidlock);
 		return nil;
+	}
+	if(2*(c->nused+1) > c->nfids)
+		fidgrow(c);
 	f = mkfid(fid, user);
-	*hp = f;
+	c->fids[fidslot(c, fid)] = f;
+	c->nused++;
+	unlock(&c->fidlock);
 	return f;
 }
 
 static void
-clunkfid(Fid *f)
+clunkfid(Conn *c, Fid *f)
 {
-	Fid **hp;
+	u32int fid;
+	uint i;
 
-	hp = hashfid(f->fid);
-	if((f = *hp) != nil){
-		*hp = f->next;
+	fid = f->fid;
+	f = nil;
+	lock(&c->fidlock);
+	if(c->nfids != 0){
+		i = fidslot(c, fid);
+		if((f = c->fids[i]) != nil)
+			fiddel(c, i);
+	}
+	unlock(&c->fidlock);
+	if(f != nil)
 		putfid(f);
-	}else
-		fprint(2, "nubfs: clunkfid no fid %ud\n", f->fid);	/* eventually, fatal */
+	else
+		fprint(2, "nubfs: clunkfid no fid %ud\n", fid);	/* eventually, fatal */
+}
+
+/*
+ * the connection has gone, or Tversion started afresh: clunk whatever it left open
+ */
+static void
+clunkall(Conn *c)
+{
+	Fid *f;
+	uint i;
+
+	for(i = 0; i < c->nfids; i++){
+		if((f = c->fids[i]) != nil){
+			c->fids[i] = nil;
+			if(!waserror()){
+				nubclunk(f);
+				poperror();
+			}
+			putfid(f);
+		}
+	}
+	free(c->fids);
+	c->fids = nil;
+	c->nfids = c->nused = 0;
 }
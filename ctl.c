@@ -6,6 +6,7 @@
 #include "fns.h"
 
 static usize ctlio(Fid*, void*, usize, u64int, int);
+static usize histio(Fid*, void*, usize, u64int, int);
 
 void
 ctlinit(Entry *r, String *user)
@@ -16,6 +17,15 @@ ctlinit(Entry *r, String *user)
 	cf->io = ctlio;
 }
 
+void
+histinit(Entry *r, String *user)
+{
+	Entry *hf;
+
+	hf = mkentry(r, "latency", (Qid){3, 0, 0}, 0444, user, user, NOW, 0);
+	hf->io = histio;
+}
+
 static usize
 ctlwrite(Fid *f, void *a, usize count)
 {
@@ -46,7 +56,24 @@ ctlwrite(Fid *f, void *a, usize count)
 		nopermcheck = 1;
 	else if(strcmp(flds[0], "nopermit") == 0)
 		nopermcheck = 0;
-	else
+	else if(strcmp(flds[0], "resetlatency") == 0)
+		histreset();
+	else if(strcmp(flds[0], "trace") == 0 && n == 2 && strcmp(flds[1], "on") == 0)
+		tracing = 1;
+	else if(strcmp(flds[0], "trace") == 0 && n == 2 && strcmp(flds[1], "off") == 0)
+		tracing = 0;
+	else if(strcmp(flds[0], "inline") == 0 && n == 2){
+		n = atoi(flds[1]);
+		if(n < 0 || n > Maxinline)
+			raise(Ebadctl);
+		inlinemax = n;
+	}else if(strcmp(flds[0], "datamode") == 0 && n == 3){
+		if(strcmp(flds[2], "inherit") == 0)
+			n = 0;
+		else if((n = datamodename(flds[2])) <= 0)
+			raise(Ebadctl);
+		nubdatamode(flds[1], n);
+	}else
 		raise(Ebadctl);
 	return count;
 }
@@ -54,8 +81,35 @@ ctlwrite(Fid *f, void *a, usize count)
 static usize
 ctlio(Fid *f, void *a, usize count, u64int offset, int write)
 {
-	USED(offset);
+	char *s;
+	usize n;
+
 	if(write)
 		return ctlwrite(f, a, count);
-	return 0;
+	s = fidsnap(f, offset, nubmemstats);
+	n = strlen(s);
+	if(offset > n)
+		offset = n;
+	if(offset+count > n)
+		count = n-offset;
+	memmove(a, s+offset, count);
+	return count;
+}
+
+static usize
+histio(Fid *f, void *a, usize count, u64int offset, int write)
+{
+	char *s;
+	usize n;
+
+	if(write)
+		raise(Eperm);
+	s = fidsnap(f, offset, histread);
+	n = strlen(s);
+	if(offset > n)
+		offset = n;
+	if(offset+count > n)
+		count = n-offset;
+	memmove(a, s+offset, count);
+	return count;
 }
@@ -7,7 +7,10 @@
 #include "errors.h"
 
 typedef struct Array Array;
+typedef struct Chunk Chunk;
+typedef struct Dirhash Dirhash;
 typedef struct Disk Disk;
+typedef struct Diskvec Diskvec;
 typedef struct Entry Entry;
 typedef struct Excl Excl;
 typedef struct Extent Extent;
@@ -15,30 +18,91 @@ typedef struct Fid Fid;
 typedef struct LogEntry LogEntry;
 typedef struct LogFile LogFile;
 typedef struct Nubfs Nubfs;
+typedef struct Readahead Readahead;
+typedef struct Statbuf Statbuf;
+typedef struct Slab Slab;
 typedef struct String String;
 typedef struct User User;
 typedef struct Walkqid Walkqid;
+typedef struct Wbuf Wbuf;
 
+#pragma incomplete Chunk
 #pragma incomplete Disk
 #pragma incomplete LogFile
+#pragma incomplete Readahead
+#pragma incomplete Wbuf
 
 typedef u64int	DiskOffset;
-typedef u32int	FileOffset;
+typedef u64int	FileOffset;
 
 enum{
-	Nextent=	24,
+	Nextent=	1<<15,	/* extents in a file; the index is 15 bits in the log */
+	Maxextent=	1<<30,	/* largest extent, in bytes */
 
 	Tlock=	5*60,	/* seconds */
+
+	Dirhashmin=	32,	/* entries before a directory is indexed */
+
+	Maxinline=	1024,	/* largest file kept in the log, well within a log block */
+
+	/* data modes */
+	Ordered=	1,	/* data on disk before the log entries describing it */
+	Writeback=	2,	/* data and log reach the disk independently */
+};
+
+struct Dirhash {
+	uint	n;	/* power of 2 */
+	Entry**	tab;
+};
+
+/* latency histograms: 9P requests by T-message type, then these */
+enum{
+	Hdiskread=	Tmax,
+	Hdiskwrite,
+	Hlogappend,
+	Hflushpage,
+	Hsweeplog,
+	Hlogcommit,
+	Nhist
+};
+
+/* trace records: see trace.c for the layout */
+enum{
+	Tracesize=	48,
+
+	/* kinds */
+	Trreq=	'q',	/* 9P request answered */
+	Trerr=	'e',	/* 9P request failed */
+	Trlog=	'l',	/* log entry appended */
 };
 
 struct Array {
 	int	len;
 };
 
+/*
+ * allocator for small objects of one type, see slab.c;
+ * statically initialised with name and size
+ */
+struct Slab {
+	Lock;
+	char*	name;
+	usize	size;
+	Chunk*	partial;	/* chunks with free objects */
+	int	listed;
+	usize	csize;	/* bytes in a chunk */
+	ulong	nchunk;
+	ulong	nspare;	/* chunks wholly free */
+	ulong	inuse;
+	uvlong	nalloc;
+	Slab*	link;	/* all slabs, for statistics */
+};
+
 struct String {
 	Ref;
 	uint	hash;
 	uint	n;
+	uint	uix;	/* user index in group membership sets, once it's a user or member */
 	String*	next;
 	char	s[];
 };
@@ -59,47 +123,100 @@ struct Extent {
 	FileOffset	 length;		/* extent length in bytes */
 };
 
+/*
+ * one piece of a scattered disk transfer
+ */
+struct Diskvec {
+	uchar*	p;
+	usize	n;
+	u64int	offset;	/* in partition */
+};
+
+enum{
+	Nvec=	16,	/* pieces gathered for one batch of disk transfers */
+};
+
 struct Excl {
 	Fid*	fid;
 	u32int	time;
 };
 
+/*
+ * an Entry's packed stat, and what it was made from
+ */
+struct Statbuf {
+	Lock;
+	uchar*	buf;
+	uint	n;
+	ulong	gen;	/* the entry's statgen when packed */
+	ulong	usersgen;
+};
+
 struct Entry {
 	Ref;
-	Entry*	pnext;	/* path list */
-	Entry*	dnext;	/* directory list */
-	Excl*	excl;	/* exclusive open */
+	QLock;	/* contents, directory list, excl */
 
+	/* used on every walk and stat */
 	Qid	qid;
-	Entry*	parent;
-	char*	name;
-	String*	uid;
-	String*	gid;
-	String*	muid;
-	u32int	atime;
-	u32int	mtime;
 	u32int	mode;
+	uchar	dmode;	/* data mode below a directory, or 0 to inherit */
+	Entry*	parent;
+	String*	name;
 	union{
 		struct{
-			Entry*	files;
+			Entry*	files;	/* in order of creation */
+			Entry*	lastfile;
+			Dirhash*	hash;	/* index by name, once big enough */
+			ulong	wgen;	/* walk cache generation */
+			int	nfiles;
 		};	/* Dir */
 		struct{
-			u32int	cvers;	/* version of last create or trunc */
 			FileOffset	length;
+			u32int	cvers;	/* version of last create or trunc */
+			ushort	nd;
+			ushort	nalloc;	/* size of data */
+			Extent*	data;	/* in order of allocation, the index in the log */
+			FileOffset*	start;	/* start[i] is the file offset of data[i], in the same block */
+			u16int*	order;	/* indices of data in file order, in the same block */
+			uchar*	idata;	/* contents of a small file, instead of extents */
+			u64int	iseq;	/* log sequence of the Inline entry holding them */
+			Wbuf*	wb;	/* writes not yet on disk */
 			usize	(*io)(Fid*, void*, usize, u64int, int);
-			int	nd;
-			Extent	data[Nextent];
 		};	/* File */
 	};
+
+	String*	uid;
+	String*	gid;
+	String*	muid;
+	u32int	atime;
+	u32int	mtime;
+	Entry*	pnext;	/* path list */
+	Entry*	dnext;	/* directory list */
+	Entry*	dprev;
+	Entry*	hnext;	/* parent's Dirhash chain */
+	Excl*	excl;	/* exclusive open */
+	Statbuf*	stat;	/* once stat'd */
+	ulong	statgen;	/* bumped, with the entry locked, when what stat shows changes */
 };
 
 struct Fid {
+	Ref;
+	QLock;	/* held by the request using the fid */
 	u32int	fid;
 	int	open;
 	Entry*	entry;
 	String*	user;
 
-	Fid*	next;
+	/* directory read cursor: next entry to read is at offset diroff */
+	u64int	diroff;
+	Entry*	dirent;	/* nil at the end */
+	u32int	dirvers;	/* of the directory, when the cursor was set */
+
+	char*	snap;	/* contents of a generated file, made at offset 0 */
+	ulong	traced;	/* last trace record read on the fid */
+
+	u64int	nextoff;	/* where a sequential read would start */
+	Readahead*	ra;	/* once reading sequentially */
 };
 
 enum{
@@ -111,8 +228,11 @@ enum{
 	Tlog1,
 	Tlog2,
 	Tlog3,
+};
 
-	NewExtent=	0x80,		/* new extent was allocated to Log Write request */
+enum{
+	NewExtent=	0x8000,		/* new extent was allocated to Log Write request */
+	NewExtent32=	0x80,		/* in a Write32 entry */
 };
 
 struct Walkqid
@@ -138,10 +258,15 @@ enum{
 	Create=	'c',
 	Trunc=	't',
 	Remove=	'r',
-	Write=	'w',
+	Write=	'x',
+	Writesum=	'X',	/* Write with a checksum of its data (writeback), unpacked as Write */
+	Write32=	'w',	/* Write with 32-bit offsets and extent index, read only */
 	Wstat=	'W',
+	Inline=	'i',	/* whole contents of a small file */
+	Datamode=	'd',	/* data mode of a directory */
 	Sync=	'S',
-	Mark=	'z',	/* log was closed at this point (unused) */
+	Mark=	'z',	/* data described by earlier entries is on disk */
+	Synced=	'y',	/* data described by entries up to synced.upto is on disk */
 };
 
 struct LogEntry
@@ -177,7 +302,8 @@ struct LogEntry
 			u32int	cvers;
 			u32int	eoff;
 			Extent	ext;
-			uchar	exind;
+			u16int	exind;
+			u32int	sum;	/* of the data in writeback mode, else 0 */
 		} write;
 		struct{	/* Wstat */
 			u32int	perm;
@@ -189,6 +315,19 @@ struct LogEntry
 			u32int	atime;
 			/* TO DO: length */
 		} wstat;
+		struct{
+			u32int	mtime;
+			char*	muid;
+			u32int	cvers;
+			u32int	length;
+			uchar*	data;	/* length bytes */
+		} inl;
+		struct{
+			uchar	mode;
+		} datamode;
+		struct{
+			u64int	upto;	/* seq */
+		} synced;
 		/* Sync (no parameters) */
 		/* Mark (no parameters) */
 	};
@@ -200,16 +339,19 @@ struct Context {
 	char	errbuf[ERRMAX+1];
 	int	nerror;
 	jmp_buf	errors[8];
+	int*	flushed;	/* set when the current request is flushed */
 };
 
-Context staticctx;
 uchar debug[256];
 int	exiting;
 int	wstatallow;
 int	nopermcheck;
+int	tracing;
+int	inlinemax;
+int	datamode;
 
-#define	waserror()	(staticctx.nerror++, setjmp(staticctx.errors[staticctx.nerror-1]))
-#define	poperror()	staticctx.nerror--
+#define	waserror()	(getctx()->nerror++, setjmp(getctx()->errors[getctx()->nerror-1]))
+#define	poperror()	getctx()->nerror--
 
 #define	NOW	time(nil)
 #define	DBG(x)	if(debug[(x)])
@@ -52,17 +52,27 @@ logpacksize(LogEntry *l)
 
 	case Write:
 		n += BIT32SZ;	/* mtime */
-		n += BIT32SZ;	/* offset */
+		n += BIT64SZ;	/* offset */
 		n += BIT32SZ;	/* count */
 		n += BIT32SZ;	/* vers */
 		n += BIT32SZ;	/* cvers */
 		n += BIT32SZ;	/* eoff */
 		n += BIT64SZ;	/* ext.base */
 		n += BIT32SZ;	/* ext.length */
-		n += BIT8SZ;	/* exind */
+		n += BIT16SZ;	/* exind */
+		if(l->write.sum != 0)
+			n += BIT32SZ;	/* sum, as Writesum */
 		n += logstrsize(l->write.muid);
 		break;
 
+	case Datamode:
+		n += BIT8SZ;	/* mode */
+		break;
+
+	case Synced:
+		n += BIT64SZ;	/* upto */
+		break;
+
 	case Wstat:
 		n += BIT32SZ;	/* perm */
 		n += BIT32SZ;	/* mtime */
@@ -73,7 +83,16 @@ logpacksize(LogEntry *l)
 		n += logstrsize(l->wstat.muid);
 		break;
 
+	case Inline:
+		n += BIT32SZ;	/* mtime */
+		n += BIT32SZ;	/* cvers */
+		n += BIT16SZ;	/* length */
+		n += l->inl.length;
+		n += logstrsize(l->inl.muid);
+		break;
+
 	case Sync:
+	case Mark:
 		break;
 	}
 	return n;
@@ -108,7 +127,10 @@ logpack(uchar *s, uint avail, LogEntry *l)
 	p = s;
 	PBIT16(p, n);
 	p += BIT16SZ;
-	PBIT8(p, l->op);
+	if(l->op == Write && l->write.sum != 0)
+		PBIT8(p, Writesum);
+	else
+		PBIT8(p, l->op);
 	p += BIT8SZ;
 	PBIT32(p, l->path);
 	p += BIT32SZ;
@@ -147,8 +169,8 @@ logpack(uchar *s, uint avail, LogEntry *l)
 	case Write:
 		PBIT32(p, l->write.mtime);
 		p += BIT32SZ;
-		PBIT32(p, l->write.offset);
-		p += BIT32SZ;
+		PBIT64(p, l->write.offset);
+		p += BIT64SZ;
 		PBIT32(p, l->write.count);
 		p += BIT32SZ;
 		PBIT32(p, l->write.vers);
@@ -161,11 +183,25 @@ logpack(uchar *s, uint avail, LogEntry *l)
 		p += BIT64SZ;
 		PBIT32(p, l->write.ext.length);
 		p += BIT32SZ;
-		PBIT8(p, l->write.exind);
-		p += BIT8SZ;
+		PBIT16(p, l->write.exind);
+		p += BIT16SZ;
+		if(l->write.sum != 0){
+			PBIT32(p, l->write.sum);
+			p += BIT32SZ;
+		}
 		p = logputs(p, l->write.muid);
 		break;
 
+	case Datamode:
+		PBIT8(p, l->datamode.mode);
+		p += BIT8SZ;
+		break;
+
+	case Synced:
+		PBIT64(p, l->synced.upto);
+		p += BIT64SZ;
+		break;
+
 	case Wstat:
 		PBIT32(p, l->wstat.perm);
 		p += BIT32SZ;
@@ -179,6 +215,20 @@ logpack(uchar *s, uint avail, LogEntry *l)
 		p = logputs(p, l->wstat.muid);
 		break;
 
+	case Inline:
+		if(l->inl.length > Maxinline)
+			error("logpack inline data too long");
+		PBIT32(p, l->inl.mtime);
+		p += BIT32SZ;
+		PBIT32(p, l->inl.cvers);
+		p += BIT32SZ;
+		PBIT16(p, l->inl.length);
+		p += BIT16SZ;
+		memmove(p, l->inl.data, l->inl.length);
+		p += l->inl.length;
+		p = logputs(p, l->inl.muid);
+		break;
+
 	case Sync:
 	case Mark:
 		break;
@@ -266,8 +316,55 @@ logunpack(uchar *ap, uint nap, LogEntry *l)
 		break;
 
 	case Write:
+	case Writesum:
+		if(p+6*BIT32SZ+2*BIT64SZ+BIT16SZ+(l->op == Writesum? BIT32SZ: 0) > ep)
+			return 0;
+		l->write.mtime = GBIT32(p);
+		p += BIT32SZ;
+		l->write.offset = GBIT64(p);
+		p += BIT64SZ;
+		l->write.count = GBIT32(p);
+		p += BIT32SZ;
+		l->write.vers = GBIT32(p);
+		p += BIT32SZ;
+		l->write.cvers = GBIT32(p);
+		p += BIT32SZ;
+		l->write.eoff = GBIT32(p);
+		p += BIT32SZ;
+		l->write.ext.base = GBIT64(p);
+		p += BIT64SZ;
+		l->write.ext.length = GBIT32(p);
+		p += BIT32SZ;
+		l->write.exind = GBIT16(p);
+		p += BIT16SZ;
+		l->write.sum = 0;
+		if(l->op == Writesum){
+			l->op = Write;
+			l->write.sum = GBIT32(p);
+			p += BIT32SZ;
+		}
+		p = loggets(p, ep, &l->write.muid);
+		break;
+
+	case Datamode:
+		if(p+BIT8SZ > ep)
+			return 0;
+		l->datamode.mode = GBIT8(p);
+		p += BIT8SZ;
+		break;
+
+	case Synced:
+		if(p+BIT64SZ > ep)
+			return 0;
+		l->synced.upto = GBIT64(p);
+		p += BIT64SZ;
+		break;
+
+	case Write32:
+		/* earlier format, converted to Write */
 		if(p+8*BIT32SZ+BIT8SZ > ep)
 			return 0;
+		l->op = Write;
 		l->write.mtime = GBIT32(p);
 		p += BIT32SZ;
 		l->write.offset = GBIT32(p);
@@ -280,11 +377,14 @@ logunpack(uchar *ap, uint nap, LogEntry *l)
 		p += BIT32SZ;
 		l->write.eoff = GBIT32(p);
 		p += BIT32SZ;
-		l->write.ext.base = GBIT32(p);
+		l->write.ext.base = GBIT64(p);
 		p += BIT64SZ;
 		l->write.ext.length = GBIT32(p);
 		p += BIT32SZ;
-		l->write.exind = GBIT8(p);
+		l->write.exind = GBIT8(p) & ~NewExtent32;
+		if(GBIT8(p) & NewExtent32)
+			l->write.exind |= NewExtent;
+		l->write.sum = 0;
 		p += BIT8SZ;
 		p = loggets(p, ep, &l->write.muid);
 		break;
@@ -304,6 +404,22 @@ logunpack(uchar *ap, uint nap, LogEntry *l)
 		p = loggets(p, ep, &l->wstat.muid);
 		break;
 
+	case Inline:
+		if(p+2*BIT32SZ+BIT16SZ > ep)
+			return 0;
+		l->inl.mtime = GBIT32(p);
+		p += BIT32SZ;
+		l->inl.cvers = GBIT32(p);
+		p += BIT32SZ;
+		l->inl.length = GBIT16(p);
+		p += BIT16SZ;
+		if(p+l->inl.length > ep)
+			return 0;
+		l->inl.data = p;	/* as for strings */
+		p += l->inl.length;
+		p = loggets(p, ep, &l->inl.muid);
+		break;
+
 	case Sync:
 	case Mark:
 		break;
@@ -333,14 +449,21 @@ fmtL(Fmt *f)
 	case Remove:
 		return n+fmtprint(f, "Remove path %#ux mtime %ud muid %#q", l->path, l->remove.mtime, l->remove.muid);
 	case Write:
-		return n+fmtprint(f, "Write path %#ux mtime %ud muid %#q offset %ud count %ud vers %ud cvers %ud eoff %ud ext %#llux %#ux exind %#ux",
+		return n+fmtprint(f, "Write path %#ux mtime %ud muid %#q offset %llud count %llud vers %ud cvers %ud eoff %ud ext %#llux %#llux exind %#ux sum %#ux",
 			l->path, l->write.mtime, l->write.muid, l->write.offset, l->write.count, l->write.vers, l->write.cvers, l->write.eoff,
-			l->write.ext.base, l->write.ext.length, l->write.exind);
+			l->write.ext.base, l->write.ext.length, l->write.exind, l->write.sum);
 	case Wstat:
 		return n+fmtprint(f, "Wstat path %#ux perm %#uo name %#q uid %#q gid %#q muid %#q mtime %ud atime %ud",
 			l->path, l->wstat.perm, l->wstat.name, l->wstat.uid, l->wstat.gid, l->wstat.muid, l->wstat.mtime, l->wstat.atime);
+	case Inline:
+		return n+fmtprint(f, "Inline path %#ux mtime %ud muid %#q cvers %ud length %ud",
+			l->path, l->inl.mtime, l->inl.muid, l->inl.cvers, l->inl.length);
+	case Datamode:
+		return n+fmtprint(f, "Datamode path %#ux mode %d", l->path, l->datamode.mode);
 	case Mark:
 		return n+fmtprint(f, "Mark");
+	case Synced:
+		return n+fmtprint(f, "Synced upto %llud", l->synced.upto);
 	case Sync:
 		return n+fmtprint(f, "Sync");
 	default:
@@ -27,3 +27,5 @@ char	Enomem[];	/* out of memory */
 char	Etoobig[];	/* read or write too large */
 char	Elockbroken[];	/* exclusive lock broken */
 char	Elocked[];	/* exclusive lock */
+char	Eflushed[];	/* request flushed */
+char	Ewalk[];	/* walk -- too many names */
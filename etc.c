@@ -5,8 +5,6 @@
 #include	"dat.h"
 #include	"fns.h"
 
-Context	staticctx;
-
 void
 error(char *s, ...)
 {
@@ -19,7 +17,21 @@ error(char *s, ...)
 	fprint(2, "%s\n", b);
 	if(debug['D'])
 		abort();
-	exits("error");
+	threadexitsall("error");
+}
+
+/*
+ * each proc has its own error stack, in its thread-private data
+ */
+Context*
+getctx(void)
+{
+	Context **p;
+
+	p = (Context**)threaddata();
+	if(*p == nil)
+		*p = emallocz(sizeof(Context), 1);
+	return *p;
 }
 
 void
@@ -27,7 +39,7 @@ raise(char *err)
 {
 	Context *ctx;
 
-	ctx = &staticctx;	/* TO DO: privates */
+	ctx = getctx();
 	if(err != nil)
 		werrstr("%s", err);
 	if(ctx->nerror <= 0 || ctx->nerror > nelem(ctx->errors))
@@ -36,6 +48,19 @@ raise(char *err)
 	longjmp(ctx->errors[ctx->nerror], 1);
 }
 
+/*
+ * long operations call this at convenient points,
+ * to give up early on requests that have been flushed
+ */
+int
+interrupted(void)
+{
+	Context *ctx;
+
+	ctx = getctx();
+	return ctx->flushed != nil && *ctx->flushed;
+}
+
 void*
 emallocz(usize n, int zero)
 {
@@ -48,6 +73,48 @@ emallocz(usize n, int zero)
 	return p;
 }
 
+/*
+ * commit the file to stable storage: on Plan 9 a wstat changing nothing
+ * asks the file server for that (stat(5)); under plan9port
+ * it does nothing, so fsync is used there
+ */
+int
+fdsync(int fd)
+{
+#ifdef PLAN9PORT
+	return fsync(fd);
+#else
+	Dir d;
+
+	nulldir(&d);
+	return dirfwstat(fd, &d);
+#endif
+}
+
+int
+datamodename(char *s)
+{
+	if(strcmp(s, "ordered") == 0)
+		return Ordered;
+	if(strcmp(s, "writeback") == 0)
+		return Writeback;
+	return -1;
+}
+
+/*
+ * checksum of data written in writeback mode (FNV-1a); never 0
+ */
+u32int
+datasum(uchar *p, usize n)
+{
+	u32int h;
+
+	h = 2166136261U;
+	while(n-- > 0)
+		h = (h ^ *p++) * 16777619;
+	return h != 0? h: 1;
+}
+
 char*
 estrdup(char *s)
 {
@@ -8,6 +8,9 @@
 
 #include	"dat.h"
 #include	"fns.h"
+#ifdef PLAN9PORT
+#include	<sys/uio.h>
+#endif
 
 enum{
 	Nslice=	32,
@@ -19,16 +22,72 @@ struct Slice {
 	Slice*	next;
 };
 
+/*
+ * sector cache, with 2Q replacement (Johnson and Shasha, VLDB 1994):
+ * a sector read once goes on a short FIFO (in); one read again after
+ * leaving it, while still remembered on the ghost list (out), goes on the
+ * LRU list (main). a single long scan passes through in without
+ * disturbing main.
+ */
+enum{
+	Qin,
+	Qout,	/* ghosts: addresses only */
+	Qmain,
+	Nq,
+
+	Maxrun=	64,	/* sectors read at once on a miss */
+};
+
+typedef struct Cblock Cblock;
+struct Cblock {
+	u64int	addr;	/* sector */
+	int	q;
+	Cblock*	hnext;
+	Cblock*	next;	/* towards the tail of the queue, or free list */
+	Cblock*	prev;
+	uchar*	data;	/* nil for a ghost */
+};
+
+typedef struct Cqueue Cqueue;
+struct Cqueue {
+	Cblock*	head;	/* most recent */
+	Cblock*	tail;
+	int	n;
+};
+
+typedef struct Cache Cache;
+struct Cache {
+	Lock;
+	int	nblock;
+	int	kin;	/* size of in, before it gives up blocks */
+	int	kout;	/* ghosts remembered */
+	Cblock*	blocks;
+	Cblock*	free;
+	Cblock**	hash;
+	uint	nhash;	/* power of 2 */
+	Cqueue	q[Nq];
+	u64int	gen;	/* changed by every invalidation */
+	uvlong	hits;
+	uvlong	misses;
+	uvlong	promoted;	/* from out to main */
+};
+
 typedef struct Disk Disk;
 struct Disk {
+	Lock;	/* allocation state; reads and writes are unlocked */
 	int	fd;
 	u64int	base;
 	uint	secsize;
 	uint	secshift;
 	Slice*	slices[Nslice];
-	Slice*	freeslices;
+	Cache*	cache;	/* nil if not caching */
 };
 
+static Slab	sliceslab = {.name = "Slice", .size = sizeof(Slice)};
+static Slab	ghostslab = {.name = "Cblock", .size = sizeof(Cblock)};
+
+static void	cacheinval(Disk*, u64int, u64int);
+
 /*
  * log2
  */
@@ -60,10 +119,10 @@ log2of(uint n)
 }
 
 static void freeslice(Disk*, u64int, u32int);
-static void freeslices(Disk*, u64int, u32int);
+static void freeslices(Disk*, u64int, u64int);
 
 Disk*
-diskinit(int fd, uint secsize, u64int base, u32int length)
+diskinit(int fd, uint secsize, u64int base, u64int length)
 {
 	Disk *disk;
 
@@ -90,21 +149,23 @@ allocdisk(Disk *disk, u32int size)
 
 	size = (size + disk->secsize-1) >> disk->secshift;
 	n0 = log2of(size);
+	lock(disk);
 	for(n = n0; n < Nslice; n++){
 		size = (u32int)1<<n;
 		DBG('d')print("%ud %d?\n", size, n);
 		if((s = disk->slices[n]) != nil){
 			disk->slices[n] = s->next;
 			addr = s->addr;
-			s->next = disk->freeslices;
-			disk->freeslices = s;
+			slabfree(&sliceslab, s);
 			for(; n > n0; n--){
 				size >>= 1;
 				freeslice(disk, addr+size, size);
 			}
-			return (Extent){addr<<disk->secshift, size<<disk->secshift};
+			unlock(disk);
+			return (Extent){addr<<disk->secshift, (FileOffset)size<<disk->secshift};
 		}
 	}
+	unlock(disk);
 	return (Extent){0, 0};
 }
 
@@ -118,6 +179,7 @@ allocdiskat(Disk *disk, u64int reqaddr, u32int size)
 	size = (size + disk->secsize-1) >> disk->secshift;
 	reqaddr >>= disk->secshift;
 	n0 = log2of(size);
+	lock(disk);
 	for(n = n0; n < Nslice; n++){
 		size = (u32int)1<<n;
 		DBG('d')print("at: %ud %d?\n", size, n);
@@ -127,8 +189,7 @@ allocdiskat(Disk *disk, u64int reqaddr, u32int size)
 		if(*l != nil){
 			*l = s->next;
 			addr = s->addr;
-			s->next = disk->freeslices;
-			disk->freeslices = s;
+			slabfree(&sliceslab, s);
 			if(addr != reqaddr)
 				freeslices(disk, addr, reqaddr-addr);
 			if(n != n0){
@@ -136,29 +197,34 @@ allocdiskat(Disk *disk, u64int reqaddr, u32int size)
 				freeslices(disk, avail, addr+size-avail);
 			}
 			size = 1<<n0;
-			return (Extent){reqaddr<<disk->secshift, size<<disk->secshift};
+			unlock(disk);
+			return (Extent){reqaddr<<disk->secshift, (FileOffset)size<<disk->secshift};
 		}
 	}
+	unlock(disk);
 	return (Extent){0, 0};
 }
 
 void
 freedisk(Disk *disk, Extent ext)
 {
+	cacheinval(disk, ext.base, ext.length);
+	lock(disk);
 	freeslice(disk, ext.base>>disk->secshift, ext.length>>disk->secshift);
+	unlock(disk);
 }
 
 static void
-freeslices(Disk *disk, u64int addr, u32int size)
+freeslices(Disk *disk, u64int addr, u64int size)
 {
 	uint i;
-	u32int m;
+	u64int m;
 
-	DBG('d')print("freeslices %#llux %ud\n", addr, size);
+	DBG('d')print("freeslices %#llux %llud\n", addr, size);
 
 	/* align the address */
-	for(i=0; i<32; i++){
-		m = (u32int)1<<i;
+	for(i=0; i<Nslice-1; i++){
+		m = (u64int)1<<i;
 		if(size < m)
 			break;
 		if(addr & m){
@@ -167,11 +233,15 @@ freeslices(Disk *disk, u64int addr, u32int size)
 			addr += m;
 		}
 	}
-	if(size == 0)
-		return;
+
+	/* as many of the largest slices as fit */
+	m = (u64int)1<<(Nslice-1);
+	for(; size >= m; size -= m){
+		freeslice(disk, addr, m);
+		addr += m;
+	}
 
 	/* split the size */
-	m = (u32int)1<<log2of(size);
 	for(; size != 0; m >>= 1){
 		if((size & m) != 0){
 			freeslice(disk, addr, m);
@@ -193,15 +263,14 @@ freeslice(Disk *disk, u64int addr, u32int size)
 	n = log2of(size);
 	size = (u32int)1<<n;
 	l = &disk->slices[n];
-	while(n < Nslice && (s = *l) != nil){
+	while(n < Nslice-1 && (s = *l) != nil){
 		DBG('d')print("merge? %#llux %#llux %#ux\n", addr, s->addr, size);
 		if((s->addr^addr) == size){	/* buddy? */
 			DBG('d')print("merge %#llux %#llux %#ux\n", addr, s->addr, size);
 			if(s->addr < addr)
 				addr = s->addr;
 			*l = s->next;
-			s->next = disk->freeslices;
-			disk->freeslices = s;
+			slabfree(&sliceslab, s);
 			n++;
 			size <<= 1;
 			l = &disk->slices[n];
@@ -212,12 +281,7 @@ freeslice(Disk *disk, u64int addr, u32int size)
 		}
 	}
 	DBG('d')print("free %llud %ud %d\n", addr, size, n);
-	s = disk->freeslices;
-	if(s != nil){
-		disk->freeslices = s->next;
-		s->next = nil;
-	}else
-		s = emallocz(sizeof(*s), 1);
+	s = slaballoc(&sliceslab, 1);
 	s->addr = addr;
 	s->next = *l;
 	*l = s;
@@ -231,6 +295,7 @@ diskdump(Disk *disk)
 	int i;
 
 	fmtstrinit(&fmt);
+	lock(disk);
 	fmtprint(&fmt, "disk %#p slices %d\n", disk, Nslice);
 	for(i = 0; i < Nslice; i++){
 		if(disk->slices[i] != nil){
@@ -244,6 +309,7 @@ diskdump(Disk *disk)
 			fmtprint(&fmt, " [%ud]\n", (u32int)1<<i);
 		}
 	}
+	unlock(disk);
 	return fmtstrflush(&fmt);
 }
 
@@ -260,21 +326,24 @@ eqextent(Extent a, Extent b)
  * Returns number of bytes to request
  */
 u32int
-extentsize(Disk *disk, u32int b, u32int l, uint i)
+extentsize(Disk *disk, u64int b, u64int l, uint i)
 {
-	u32int p;
+	u64int p, max;
 
-	if(i >= Nextent)
+	if(i >= Nextent || b > Maxextent)
 		return 0;
+	max = Maxextent >> disk->secshift;
 	b = (b + disk->secsize - 1) >> disk->secshift;
 	l = (l + disk->secsize - 1) >> disk->secshift;
-	p = (u32int)1 << i;
-	DBG('d')print("b=%d l=%d p=%d\n", b, l, p);
+	p = i < 31? (u64int)1 << i: max;
+	DBG('d')print("b=%lld l=%lld p=%lld\n", b, l, p);
 	if(l < p)
 		p = l;
 	if(b > p)
 		p = b;
-	return 1<<(log2of(p)+disk->secshift);	/* max(b, min(l, 2**i)) */
+	if(p > max)
+		p = max;
+	return 1<<(log2of(p)+disk->secshift);	/* min(max(b, min(l, 2**i)), Maxextent) */
 }
 
 uint
@@ -289,18 +358,424 @@ byte2sec(Disk *d, u32int bytes)
 	return (bytes + d->secsize - 1)/d->secsize;
 }
 
-void
-diskread(Disk *disk, uchar *p, usize n, u64int offset)
+static void
+rdisk(Disk *disk, uchar *p, usize n, u64int offset)
 {
+	vlong t0;
+
+	t0 = nsec();
 	if(pread(disk->fd, p, n, disk->base+offset) != n)
 		raise(nil);
+	histadd(Hdiskread, nsec()-t0);
 }
 
 void
 diskwrite(Disk *disk, uchar *p, usize n, u64int offset)
 {
+	vlong t0;
+
+	t0 = nsec();
 	if(pwrite(disk->fd, p, n, disk->base+offset) != n)
 		raise(nil);
+	histadd(Hdiskwrite, nsec()-t0);
+	cacheinval(disk, offset, n);
+}
+
+void
+disksync(Disk *disk)
+{
+	if(fdsync(disk->fd) < 0)
+		error("data sync: %r");
+}
+
+/*
+ * sector cache
+ */
+
+void
+diskcache(Disk *disk, uvlong bytes)
+{
+	Cache *c;
+	uchar *data;
+	int i;
+
+	if(disk->cache != nil || bytes < disk->secsize)
+		return;
+	c = emallocz(sizeof(*c), 1);
+	c->nblock = bytes >> disk->secshift;
+	c->kin = c->nblock/4;
+	c->kout = c->nblock/2;
+	for(c->nhash = 64; c->nhash < c->nblock+c->kout; c->nhash <<= 1)
+		;
+	c->hash = emallocz(c->nhash*sizeof(*c->hash), 1);
+	c->blocks = emallocz(c->nblock*sizeof(*c->blocks), 1);
+	data = emallocz((uvlong)c->nblock << disk->secshift, 0);
+	for(i = 0; i < c->nblock; i++){
+		c->blocks[i].data = data + ((uvlong)i << disk->secshift);
+		c->blocks[i].q = -1;
+		c->blocks[i].next = c->free;
+		c->free = &c->blocks[i];
+	}
+	disk->cache = c;
+}
+
+static Cblock**
+cachehash(Cache *c, u64int addr)
+{
+	return &c->hash[(addr*0x9E3779B1) & (c->nhash-1)];
+}
+
+static Cblock*
+cachelook(Cache *c, u64int addr)
+{
+	Cblock *b;
+
+	for(b = *cachehash(c, addr); b != nil; b = b->hnext)
+		if(b->addr == addr)
+			return b;
+	return nil;
+}
+
+static void
+cacheunhash(Cache *c, Cblock *b)
+{
+	Cblock **l;
+
+	for(l = cachehash(c, b->addr); *l != nil; l = &(*l)->hnext)
+		if(*l == b){
+			*l = b->hnext;
+			break;
+		}
+	b->hnext = nil;
+}
+
+static void
+qremove(Cache *c, Cblock *b)
+{
+	Cqueue *q;
+
+	q = &c->q[b->q];
+	if(b->prev != nil)
+		b->prev->next = b->next;
+	else
+		q->head = b->next;
+	if(b->next != nil)
+		b->next->prev = b->prev;
+	else
+		q->tail = b->prev;
+	b->next = b->prev = nil;
+	b->q = -1;
+	q->n--;
+}
+
+static void
+qpush(Cache *c, Cblock *b, int n)
+{
+	Cqueue *q;
+
+	q = &c->q[n];
+	b->q = n;
+	b->prev = nil;
+	b->next = q->head;
+	if(q->head != nil)
+		q->head->prev = b;
+	else
+		q->tail = b;
+	q->head = b;
+	q->n++;
+}
+
+static void
+ghostfree(Cache *c, Cblock *g)
+{
+	qremove(c, g);
+	cacheunhash(c, g);
+	slabfree(&ghostslab, g);
+}
+
+/*
+ * a block for new data, from the free list or by replacement;
+ * a block leaving in is remembered as a ghost
+ */
+static Cblock*
+cachevictim(Cache *c)
+{
+	Cblock *b, *g;
+
+	if((b = c->free) != nil){
+		c->free = b->next;
+		b->next = nil;
+		return b;
+	}
+	if(c->q[Qin].n > c->kin || c->q[Qmain].n == 0){
+		b = c->q[Qin].tail;
+		qremove(c, b);
+		cacheunhash(c, b);
+		if(c->kout > 0){
+			g = slaballoc(&ghostslab, 1);
+			g->addr = b->addr;
+			qpush(c, g, Qout);
+			g->hnext = *cachehash(c, g->addr);
+			*cachehash(c, g->addr) = g;
+			if(c->q[Qout].n > c->kout)
+				ghostfree(c, c->q[Qout].tail);
+		}
+	}else{
+		b = c->q[Qmain].tail;
+		qremove(c, b);
+		cacheunhash(c, b);
+	}
+	return b;
+}
+
+/* called with c locked */
+static void
+cacheput(Cache *c, u64int addr, uchar *data, uint secsize)
+{
+	Cblock *b;
+	int q;
+
+	q = Qin;
+	b = cachelook(c, addr);
+	if(b != nil){
+		if(b->data != nil)
+			return;	/* another reader got there first */
+		ghostfree(c, b);
+		c->promoted++;
+		q = Qmain;
+	}
+	b = cachevictim(c);
+	b->addr = addr;
+	memmove(b->data, data, secsize);
+	qpush(c, b, q);
+	b->hnext = *cachehash(c, addr);
+	*cachehash(c, addr) = b;
+}
+
+/*
+ * forget any sectors in [offset, offset+n), without which a reader
+ * could keep data read before a write, or from space since freed
+ */
+static void
+cacheinval(Disk *disk, u64int offset, u64int n)
+{
+	Cache *c;
+	Cblock *b;
+	u64int s, s0, s1;
+	int i;
+
+	c = disk->cache;
+	if(c == nil || n == 0)
+		return;
+	s0 = offset >> disk->secshift;
+	s1 = (offset+n+disk->secsize-1) >> disk->secshift;
+	lock(c);
+	c->gen++;
+	if(s1-s0 <= c->nblock){
+		for(s = s0; s < s1; s++)
+			if((b = cachelook(c, s)) != nil && b->data != nil){
+				qremove(c, b);
+				cacheunhash(c, b);
+				b->next = c->free;
+				c->free = b;
+			}
+	}else{
+		for(i = 0; i < c->nblock; i++){
+			b = &c->blocks[i];
+			if(b->q >= 0 && b->addr >= s0 && b->addr < s1){
+				qremove(c, b);
+				cacheunhash(c, b);
+				b->next = c->free;
+				c->free = b;
+			}
+		}
+	}
+	unlock(c);
+}
+
+/* copy the part of sector s, held at d, that falls in [offset, offset+n) to p */
+static void
+secpart(Disk *disk, u64int s, uchar *d, uchar *p, usize n, u64int offset)
+{
+	u64int lo, hi;
+
+	lo = s << disk->secshift;
+	hi = lo + disk->secsize;
+	if(lo < offset){
+		d += offset-lo;
+		lo = offset;
+	}
+	if(hi > offset+n)
+		hi = offset+n;
+	memmove(p+(lo-offset), d, hi-lo);
+}
+
+/*
+ * hits are copied from the cache; each run of missing sectors
+ * is read whole, and kept unless something was invalidated meanwhile
+ */
+static void
+cacheread(Disk *disk, uchar *p, usize n, u64int offset)
+{
+	Cache *c;
+	Cblock *b;
+	u64int s, e, s0, s1, lo, hi, gen;
+	uchar *buf;
+	int tmp;
+
+	c = disk->cache;
+	s0 = offset >> disk->secshift;
+	s1 = (offset+n+disk->secsize-1) >> disk->secshift;
+	for(s = s0; s < s1; s = e){
+		lock(c);
+		b = cachelook(c, s);
+		if(b != nil && b->data != nil){
+			if(b->q == Qmain){
+				qremove(c, b);
+				qpush(c, b, Qmain);
+			}
+			secpart(disk, s, b->data, p, n, offset);
+			c->hits++;
+			unlock(c);
+			e = s+1;
+			continue;
+		}
+		for(e = s+1; e < s1 && e-s < Maxrun; e++)
+			if((b = cachelook(c, e)) != nil && b->data != nil)
+				break;
+		c->misses += e-s;
+		gen = c->gen;
+		unlock(c);
+
+		lo = s << disk->secshift;
+		hi = e << disk->secshift;
+		tmp = lo < offset || hi > offset+n;
+		if(tmp)
+			buf = emallocz(hi-lo, 0);
+		else
+			buf = p+(lo-offset);
+		if(waserror()){
+			if(tmp)
+				free(buf);
+			raise(nil);
+		}
+		rdisk(disk, buf, hi-lo, lo);
+		poperror();
+		lock(c);
+		if(c->gen == gen)
+			for(; s < e; s++)
+				cacheput(c, s, buf+((s<<disk->secshift)-lo), disk->secsize);
+		unlock(c);
+		if(tmp){
+			for(s = lo >> disk->secshift; s < e; s++)
+				secpart(disk, s, buf+((s<<disk->secshift)-lo), p, n, offset);
+			free(buf);
+		}
+	}
+}
+
+void
+diskread(Disk *disk, uchar *p, usize n, u64int offset)
+{
+	if(disk->cache != nil)
+		cacheread(disk, p, n, offset);
+	else
+		rdisk(disk, p, n, offset);
+}
+
+void
+diskcachestats(Disk *disk, Fmt *f)
+{
+	Cache *c;
+
+	c = disk->cache;
+	if(c == nil)
+		return;
+	lock(c);
+	fmtprint(f, "cache blocks %d in %d main %d ghosts %d hits %llud misses %llud promoted %llud\n",
+		c->nblock, c->q[Qin].n, c->q[Qmain].n, c->q[Qout].n, c->hits, c->misses, c->promoted);
+	unlock(c);
+}
+
+/*
+ * pieces adjacent both on disk and in memory
+ * are transferred together
+ */
+static void
+diskio(Disk *disk, Diskvec *v, int nv, void (*io)(Disk*, uchar*, usize, u64int))
+{
+	uchar *p;
+	usize n;
+	u64int offset;
+	int i, j;
+
+	for(i = 0; i < nv; i = j){
+		p = v[i].p;
+		n = v[i].n;
+		offset = v[i].offset;
+		for(j = i+1; j < nv && v[j].p == p+n && v[j].offset == offset+n; j++)
+			n += v[j].n;
+		io(disk, p, n, offset);
+	}
+}
+
+#ifdef PLAN9PORT
+/*
+ * plan9port has preadv and pwritev, so pieces adjacent on disk
+ * are transferred together wherever they are in memory
+ */
+static void
+diskiov(Disk *disk, Diskvec *v, int nv, int write)
+{
+	struct iovec iov[Nvec];
+	u64int offset;
+	vlong t0;
+	usize n;
+	ssize_t r;
+	int i, j;
+
+	for(i = 0; i < nv; i = j){
+		offset = v[i].offset;
+		n = 0;
+		for(j = i; j < nv && j-i < nelem(iov) && v[j].offset == offset+n; j++){
+			iov[j-i].iov_base = v[j].p;
+			iov[j-i].iov_len = v[j].n;
+			n += v[j].n;
+		}
+		t0 = nsec();
+		if(write)
+			r = pwritev(disk->fd, iov, j-i, disk->base+offset);
+		else
+			r = preadv(disk->fd, iov, j-i, disk->base+offset);
+		if(r != n)
+			raise(nil);
+		histadd(write? Hdiskwrite: Hdiskread, nsec()-t0);
+		if(write)
+			cacheinval(disk, offset, n);
+	}
+}
+#endif
+
+void
+diskreadv(Disk *disk, Diskvec *v, int nv)
+{
+#ifdef PLAN9PORT
+	if(disk->cache == nil){
+		diskiov(disk, v, nv, 0);
+		return;
+	}
+#endif
+	diskio(disk, v, nv, diskread);
+}
+
+void
+diskwritev(Disk *disk, Diskvec *v, int nv)
+{
+#ifdef PLAN9PORT
+	diskiov(disk, v, nv, 1);
+#else
+	diskio(disk, v, nv, diskwrite);
+#endif
 }
 
 void
@@ -3,31 +3,53 @@ Fid*	nubattach(Fid*, char*, char*);
 Fid*	nubopen(Fid*, uint);
 Fid*	nubcreate(Fid*, char*, uint, u32int);
 Walkqid*	nubwalk(Fid*, Fid*, int, char**);
+void	putwalkqid(Walkqid*);
 usize	nubread(Fid*, void*, usize, u64int);
+u32int	nubiounit(Fid*, u32int);
 void	nubreplay(void);
 usize	nubwrite(Fid*, void*, usize, u64int);
+usize	readextents(Entry*, uchar*, usize, u64int);
+int	extentvec(Entry*, uchar*, usize, u64int, Diskvec*, int, usize*);
+void	nubreadv(Diskvec*, int);
+void	behindflush(Entry*);
 void	nubremove(Fid*);
-Dir*	nubstat(Fid*);
+uint	nubstat(Fid*, uchar*, uint);
 void	nubsync(Fid*);
 void	nubwstat(Fid*, Dir*);
 void	nubclunk(Fid*);
 void	nubflush(void);
 void	nubsweep(void);
+void	beginchange(void);
+void	endchange(void);
 
 Entry*	mkentry(Entry*, char*, Qid, u32int, String*, String*, u32int, u32int);
 void	putentry(Entry*);
+Entry*	dirlookup(Entry*, char*);
+void	dirunlink(Entry*);
+void	dirrename(Entry*, char*);
+void	walkstale(Entry*);
+Entry*	walklook(Entry*, String*, int, char**, Qid*);
+void	walkenter(Entry*, String*, int, char**, Entry**, ulong*, ulong);
 void	truncatefile(Entry*);
+void	addextent(Entry*, Extent, u64int);
+void	inlineset(Entry*, uchar*, usize);
+char*	nubmemstats(void);
 
-Disk*	diskinit(int, uint, u64int, u32int);
+Disk*	diskinit(int, uint, u64int, u64int);
 Extent	allocdisk(Disk*, u32int);
 Extent	allocdiskat(Disk*, u64int, u32int);
 void	diskread(Disk*, uchar*, usize, u64int);
 void	diskwrite(Disk*, uchar*, usize, u64int);
+void	diskreadv(Disk*, Diskvec*, int);
+void	diskwritev(Disk*, Diskvec*, int);
 void	diskzero(Disk*, u32int, u64int);
 void	freedisk(Disk*, Extent);
 char*	diskdump(Disk*);
+void	disksync(Disk*);
+void	diskcache(Disk*, uvlong);
+void	diskcachestats(Disk*, Fmt*);
 int	eqextent(Extent, Extent);
-u32int	extentsize(Disk*, u32int, u32int, uint);
+u32int	extentsize(Disk*, u64int, u64int, uint);
 uint	secsize(Disk*);
 uint	byte2sec(Disk*, u32int);
 
@@ -37,7 +59,12 @@ void	logsetcopy(LogFile*, int (*)(LogEntry*));
 void	logappend(LogFile*, LogEntry*);
 void	logcomplete(LogFile*);
 void	logflush(LogFile*);
+void	logsetsync(LogFile*, void (*)(void));
+void	logcommit(LogFile*);
+void	logcommitevery(LogFile*, long);
 void	logsweep(LogFile*);
+int	logwantsweep(LogFile*);
+void	logsweepwanted(LogFile*);
 
 uint	logpacksize(LogEntry*);
 int	logpack(uchar*, uint, LogEntry*);
@@ -56,30 +83,54 @@ void	putpath(Entry*);
 
 void	replayinit(Disk*);
 void	replayentry(LogEntry*, uint);
+void	replaysynced(u64int);
+void	replaycheck(void);
 int copyentry(LogEntry*);
 
 void	ctlinit(Entry*, String*);
+void	histinit(Entry*, String*);
+void	histadd(int, vlong);
+void	histreset(void);
+char*	histread(void);
+void	traceinit(Entry*, String*);
+void	trace(int, int, u32int, u32int, u64int, u32int, vlong, u64int);
 void	srvexits(char*);
+void	srvinit(int);
+void	srvlisten(char*);
+void	srvconn(int, int);
 
 void	error(char*, ...);
 void	raise(char*);
+Context*	getctx(void);
+int	interrupted(void);
 
 #pragma	varargck	argpos	error		1
 
 void*	emallocz(usize, int);
+void*	slaballoc(Slab*, int);
+void	slabfree(Slab*, void*);
+void	slabstats(Fmt*);
 void	putstring(String*);
 void	setstring(String**, String*);
 String*	string(char*);
 String*	sincref(String*);
 char*	estrdup(char*);
+int	fdsync(int);
+u32int	datasum(uchar*, usize);
+int	datamodename(char*);
+void	nubdatamode(char*, int);
 uint	hashstr(char*);
 
 String*	uid2name(char*);
 String*	name2uid(char*);
-void	adduser(char*, char*, char*, int, char**);
-int	deluser(char*);
 void	unamecmd(int, char**);
 void	usersinit(Entry*, String*);
-int	ingroup(char*, char*);
+int	ingroup(String*, String*);
+char*	fidsnap(Fid*, u64int, char* (*)(void));
+void	prefetchinit(int);
+usize	readahead(Fid*, uchar*, usize, u64int);
+void	readaheadnext(Fid*, u64int, usize);
+void	readaheadfree(Readahead*);
 int	leadsgroup(char*, char*);
+ulong	usersgen(void);
 
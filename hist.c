@@ -0,0 +1,137 @@
+#include	"dat.h"
+#include	"fns.h"
+
+/*
+ * latency histograms
+ *
+ * bucket 0 counts times under a microsecond;
+ * bucket i counts times in [2^(i-1), 2^i) microseconds.
+ * nothing here depends on the file system, so the tests can link it.
+ */
+
+enum{
+	Nbucket=	32,
+};
+
+typedef struct Hist Hist;
+struct Hist {
+	Lock;
+	uvlong	n;
+	uvlong	sum;	/* µs */
+	uvlong	max;
+	uvlong	b[Nbucket];
+};
+
+static Hist	hists[Nhist];
+
+static char*	histname[Nhist] = {
+[Tversion]	"Tversion",
+[Tauth]	"Tauth",
+[Tattach]	"Tattach",
+[Tflush]	"Tflush",
+[Twalk]	"Twalk",
+[Topen]	"Topen",
+[Tcreate]	"Tcreate",
+[Tread]	"Tread",
+[Twrite]	"Twrite",
+[Tclunk]	"Tclunk",
+[Tremove]	"Tremove",
+[Tstat]	"Tstat",
+[Twstat]	"Twstat",
+[Hdiskread]	"diskread",
+[Hdiskwrite]	"diskwrite",
+[Hlogappend]	"logappend",
+[Hflushpage]	"flushpage",
+[Hsweeplog]	"sweeplog",
+[Hlogcommit]	"logcommit",
+};
+
+/*
+ * record an operation that took ns nanoseconds
+ */
+void
+histadd(int h, vlong ns)
+{
+	Hist *p;
+	uvlong us;
+	int i;
+
+	if(h < 0 || h >= Nhist || histname[h] == nil)
+		return;
+	p = &hists[h];
+	us = ns < 0? 0: ns/1000;
+	for(i = 0; i < Nbucket-1 && us >= (1ULL<<i); i++)
+		;
+	lock(p);
+	p->n++;
+	p->sum += us;
+	if(us > p->max)
+		p->max = us;
+	p->b[i]++;
+	unlock(p);
+}
+
+void
+histreset(void)
+{
+	Hist *p;
+
+	for(p = hists; p < hists+Nhist; p++){
+		lock(p);
+		p->n = p->sum = p->max = 0;
+		memset(p->b, 0, sizeof(p->b));
+		unlock(p);
+	}
+}
+
+/* upper bound in µs of the bucket holding the given fraction (per thousand) */
+static uvlong
+percentile(Hist *p, int permil)
+{
+	uvlong want, n;
+	int i;
+
+	want = (p->n*permil + 999)/1000;
+	n = 0;
+	for(i = 0; i < Nbucket-1; i++){
+		n += p->b[i];
+		if(n >= want)
+			break;
+	}
+	if(i == Nbucket-1 || (1ULL<<i) > p->max)
+		return p->max;
+	return 1ULL<<i;
+}
+
+/*
+ * contents of the latency file (see ctl.c)
+ */
+char*
+histread(void)
+{
+	Fmt fmt;
+	Hist *p, h;
+	int i, j;
+
+	fmtstrinit(&fmt);
+	fmtprint(&fmt, "%-10s %10s %8s %8s %8s %8s %8s\n", "op", "n", "mean", "p50", "p99", "p999", "max");
+	for(i = 0; i < Nhist; i++){
+		if(histname[i] == nil)
+			continue;
+		p = &hists[i];
+		lock(p);
+		h = *p;
+		unlock(p);
+		if(h.n == 0)
+			continue;
+		fmtprint(&fmt, "%-10s %10llud %8llud %8llud %8llud %8llud %8llud\n",
+			histname[i], h.n, h.sum/h.n,
+			percentile(&h, 500), percentile(&h, 990), percentile(&h, 999), h.max);
+		fmtprint(&fmt, "\t");
+		for(j = 0; j < Nbucket; j++)
+			if(h.b[j] != 0)
+				fmtprint(&fmt, " <%llud:%llud", 1ULL<<j, h.b[j]);
+		fmtprint(&fmt, "\n");
+	}
+	return fmtstrflush(&fmt);
+}
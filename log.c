@@ -23,6 +23,10 @@ enum{
 	Logswshift=	2,
 	Nsweep=		1<<Logswshift,
 	Swmask=		Nsweep-1,
+
+	/* empty blocks */
+	Sweepat=	16,	/* fewer, and an append asks for a sweep */
+	Nreserve=	3,	/* kept for the sweep to copy into */
 };
 
 /*
@@ -92,12 +96,26 @@ struct LogSeg
 #define	swset(n) ((n)&Swmask)
 #define	mktag(n)	(Tlog0+((n)&Swmask))
 
-#define	nearlyfull(lg)	((lg)->empty.len < 3)
+#define	nearlyfull(lg)	((lg)->empty.len < Sweepat)
 
 struct LogFile
 {
+	QLock;	/* appends, flushes and sweeps */
 	int	fd;
 	int	(*copy)(LogEntry*);
+	void	(*sync)(void);	/* make the data durable */
+	u64int	appended;	/* seq of the last entry appended */
+	int	wantsweep;	/* an append found the log nearly full */
+	int	barrier;	/* ordered data must be synced before the next page write */
+	int	unsynced;	/* writeback data appended since the last data sync */
+
+	/* group commit */
+	QLock	clk;
+	Rendez	committed;	/* with clk */
+	int	committing;	/* a leader is syncing */
+	u64int	durable;	/* entries up to here are on stable storage */
+	long	interval;	/* ms between commits, if any */
+
 	u64int	length;
 	u32int	bsize;
 	uint	bshift;
@@ -140,6 +158,7 @@ logopen(int fd, u64int length)
 	lg->nblocks = nb;
 	lg->bsize = Blksize;
 	lg->bshift = Logbshift;
+	lg->committed.l = &lg->clk;
 	initseg(lg, &lg->swept);
 	initseg(lg, &lg->active);
 	scanlogfile(lg);
@@ -152,6 +171,12 @@ logsetcopy(LogFile *lg, int (*copy)(LogEntry*))
 	lg->copy = copy;
 }
 
+void
+logsetsync(LogFile *lg, void (*sync)(void))
+{
+	lg->sync = sync;
+}
+
 static void
 initseg(LogFile *lg, LogSeg *s)
 {
@@ -412,10 +437,33 @@ segappend(LogFile *lg, LogSeg *seg, LogEntry *l, int scavenging)
 	error("log buffer overflow");	/* it will never fit */
 }
 
+/*
+ * the command sequence number is assigned under the lock,
+ * so entries reach the log in sequence order
+ */
 void
 logappend(LogFile *lg, LogEntry *l)
 {
+	vlong t0;
+
+	t0 = nsec();
+	qlock(lg);
+	if(waserror()){
+		qunlock(lg);
+		raise(nil);
+	}
+	l->seq = nextcmdseq();
 	segappend(lg, &lg->active, l, 0);
+	lg->appended = l->seq;
+	if(l->op == Write){
+		if(l->write.sum == 0)
+			lg->barrier = 1;
+		else
+			lg->unsynced = 1;
+	}
+	poperror();
+	qunlock(lg);
+	histadd(Hlogappend, nsec()-t0);
 }
 
 void
@@ -463,14 +511,53 @@ logcomplete(LogFile *lg)
 		sweeplog(lg);
 }
 
+/*
+ * sweeps aren't made by appends, since the copy looks at entries
+ * their callers might be changing; an append that finds the log
+ * nearly full asks for one instead, and carries on into the reserve.
+ * the caller keeps such changes out while it sweeps.
+ */
+int
+logwantsweep(LogFile *lg)
+{
+	return lg->wantsweep;
+}
+
+void
+logsweepwanted(LogFile *lg)
+{
+	qlock(lg);
+	if(waserror()){
+		qunlock(lg);
+		raise(nil);
+	}
+	if(lg->wantsweep)
+		sweeplog(lg);
+	poperror();
+	qunlock(lg);
+}
+
 void
 logsweep(LogFile *lg)
 {
+	qlock(lg);
+	if(waserror()){
+		qunlock(lg);
+		raise(nil);
+	}
+	/*
+	 * a sweep can't be abandoned part way: the active segment's page
+	 * and generation would no longer match its blocks
+	 */
+	if(interrupted())
+		raise(Eflushed);
 	debug['l']++;
 	debug['S']++;
 	sweeplog(lg);
 	debug['l']--;
 	debug['S']--;
+	poperror();
+	qunlock(lg);
 }
 
 static void
@@ -482,8 +569,16 @@ sweeplog(LogFile *lg)
 	uchar *p, *ep;
 	LogEntry l;
 	u64int cmdseq;
+	vlong t0;
 	static int sweeps;
 
+	t0 = nsec();
+	/* everything copied will have its data on disk: see the Mark below */
+	if(lg->sync != nil){
+		lg->sync();
+		lg->barrier = 0;
+		lg->unsynced = 0;
+	}
 	page0 = &lg->active.page;	/* note: lg->active.page might be in use */
 	flushpage(lg, page0);	/* push last chunk to storage */
 	page1 = &lg->swept.page;
@@ -541,6 +636,12 @@ sweeplog(LogFile *lg)
 	/* active log is now empty: make swept log active*/
 	lg->active = lg->swept;
 	initseg(lg, &lg->swept);
+	l = (LogEntry){Mark, 0};
+	l.seq = nextcmdseq();
+	segappend(lg, &lg->active, &l, 1);
+	lg->appended = l.seq;
+	lg->wantsweep = 0;
+	histadd(Hsweeplog, nsec()-t0);
 	if(debug['q'] && ++sweeps >= debug['q'])
 		exits("swept");
 }
@@ -565,7 +666,104 @@ segspace(LogFile *lg, LogSeg *seg, uint nbytes, int scavenging)
 void
 logflush(LogFile *lg)
 {
+	qlock(lg);
 	flushpage(lg, &lg->active.page);
+	qunlock(lg);
+}
+
+/*
+ * group commit
+ *
+ * make every entry appended so far durable. the first caller to find
+ * no commit in progress leads: it writes the active page (after the data,
+ * if ordered writes need it) and syncs the log, covering every entry
+ * appended before it wrote the page; then it syncs any writeback data
+ * and notes that with a Synced entry, which replay takes as proof that
+ * the data of writes up to the page write reached the disk.
+ * (a Write is appended only once its data has been written, so
+ * the data sync covers those; later ones wait for the next commit.)
+ * callers arriving meanwhile wait for it, and are released together,
+ * or lead the next round if their entries came too late.
+ */
+void
+logcommit(LogFile *lg)
+{
+	u64int want, upto;
+	int unsynced;
+	LogEntry mark;
+	vlong t0;
+
+	qlock(lg);
+	want = lg->appended;
+	qunlock(lg);
+	qlock(&lg->clk);
+	while(lg->durable < want){
+		if(lg->committing){
+			rsleep(&lg->committed);
+			continue;
+		}
+		lg->committing = 1;
+		qunlock(&lg->clk);
+
+		t0 = nsec();
+		/*
+		 * upto is taken with the page write, under the same lock, and
+		 * flushpage syncs ordered data before it writes any page, so no
+		 * entry is counted durable before the data it describes
+		 */
+		qlock(lg);
+		upto = lg->appended;
+		flushpage(lg, &lg->active.page);
+		unsynced = lg->unsynced;
+		lg->unsynced = 0;
+		qunlock(lg);
+		if(fdsync(lg->fd) < 0)
+			error("log sync: %r");
+		if(unsynced && lg->sync != nil){
+			lg->sync();
+			mark = (LogEntry){Synced, 0, {.synced={upto}}};
+			if(!waserror()){
+				logappend(lg, &mark);	/* durable at the next commit */
+				poperror();
+			}
+		}
+		histadd(Hlogcommit, nsec()-t0);
+
+		qlock(&lg->clk);
+		lg->committing = 0;
+		if(upto > lg->durable)
+			lg->durable = upto;
+		rwakeupall(&lg->committed);
+	}
+	qunlock(&lg->clk);
+}
+
+static void
+commitproc(void *a)
+{
+	LogFile *lg;
+	long ms;
+
+	lg = a;
+	ms = lg->interval;
+	threadsetname("nubfs commit");
+	for(;;){
+		sleep(ms);
+		logcommit(lg);
+	}
+}
+
+/*
+ * commit at least every ms milliseconds
+ */
+void
+logcommitevery(LogFile *lg, long ms)
+{
+	if(ms <= 0)
+		return;
+	lg->interval = ms;
+	if(proccreate(commitproc, lg, 16*1024) < 0)
+		error("can't create commit proc: %r");
 }
 
 static void
@@ -576,8 +774,8 @@ allocpage(LogFile *lg, LogSeg *seg, int scavenging)
 
 	p = &seg->page;
 	if(!scavenging && nearlyfull(lg)){
-		sweeplog(lg);
-		if(nearlyfull(lg))// && !removing(p))
+		lg->wantsweep = 1;
+		if(lg->empty.len < Nreserve)// && !removing(p))
 			raise("file system log full");
 	}
 	nb = take(&lg->empty);
@@ -597,6 +795,7 @@ static void
 flushpage(LogFile *lg, LogBuf *p)
 {
 	LogBlk *b;
+	vlong t0;
 
 	b = p->blk;
 	if(b == nil){
@@ -609,12 +808,19 @@ flushpage(LogFile *lg, LogBuf *p)
 			fprint(2, "logflush: base %llud tag %#ux seq %llud still used only %ud\n", b->base, p->tag, p->seq, p->used);
 		return;
 	}
+	if(lg->barrier && lg->sync != nil){
+		/* ordered data must be on disk before entries describing it; logcommit relies on this */
+		lg->sync();
+		lg->barrier = 0;
+	}
 	b->tag = p->tag;
 	b->seq = p->seq;
 	b->used = p->used;
 	if(debug['l'] || debug['S'])
 		fprint(2, "logflush: base %llud tag %#ux seq %llud used %ud\n", b->base, p->tag, p->seq, p->used);
+	t0 = nsec();
 	writepage(lg, p);
+	histadd(Hflushpage, nsec()-t0);
 }
 	
 static void
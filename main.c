@@ -0,0 +1,140 @@
+/*
+ * nubfs: arguments and start-up
+ */
+
+#include	"dat.h"
+#include	"fns.h"
+
+enum
+{
+	Nlisten	= 8,	/* announce addresses */
+};
+
+char*	mountpoint = "/n/kfs";
+char*	logname;	/* TO DO: pair */
+char*	diskname;
+char*	srvfile = "#s/nubfs";
+
+static char*	listens[Nlisten];
+static int	nlisten;
+
+static void
+usage(void)
+{
+	fprint(2, "usage: %s [-Ddebug] [-a addr]... [-c cachemb] [-g commitms] [-i inlinemax] [-m ordered|writeback] [-p nproc] [-s srvname] datafile logfile\n", argv0);
+	threadexitsall("usage");
+}
+
+void
+threadmain(int argc, char **argv)
+{
+	int dfd, lfd, srvfd, pip[2], i, sflag, nproc;
+	char *p;
+	Dir *d;
+	LogFile *lf;
+	Disk *dk;
+	long cachemb, commitms;
+
+	sflag = 0;
+	nproc = 0;
+	cachemb = 0;
+	commitms = 5000;
+	ARGBEGIN{
+	case 'a':
+		if(nlisten >= nelem(listens))
+			usage();
+		listens[nlisten++] = EARGF(usage());
+		break;
+	case 'D':
+		p = ARGF();
+		if(p != nil && *p){
+			for(; *p; p++)
+				debug[*p&0xFF] = 1;
+		}
+		break;
+	case 'c':
+		cachemb = atol(EARGF(usage()));
+		if(cachemb < 0)
+			usage();
+		break;
+	case 'g':
+		commitms = atol(EARGF(usage()));
+		break;
+	case 'i':
+		inlinemax = atoi(EARGF(usage()));
+		if(inlinemax < 0 || inlinemax > Maxinline)
+			usage();
+		break;
+	case 'm':
+		datamode = datamodename(EARGF(usage()));
+		if(datamode <= 0)
+			usage();
+		break;
+	case 'p':
+		nproc = atoi(EARGF(usage()));
+		if(nproc <= 0)
+			usage();
+		break;
+	case 's':
+		srvfile = smprint("#s/%s", EARGF(usage()));
+		sflag = 1;
+		break;
+	default:
+		usage();
+	}ARGEND
+
+	if(argc != 2)
+		usage();
+	diskname = argv[0];
+	logname = argv[1];
+
+	quotefmtinstall();
+	fmtinstall('F', fcallfmt);
+	fmtinstall('D', dirfmt);
+	fmtinstall('M', dirmodefmt);
+
+	lfd = open(logname, ORDWR);
+	if(lfd < 0)
+		error("can't open %s: %r", logname);
+	d = dirfstat(lfd);
+	if(d == nil)
+		error("can't fstat %s: %r", logname);
+	lf = logopen(lfd, d->length);
+	free(d);
+
+	dfd = open(diskname, ORDWR);
+	if(dfd < 0)
+		error("can't open %s: %r", diskname);
+	d = dirfstat(dfd);
+	if(d == nil)
+		error("can't fstat %s: %r", diskname);
+
+	dk = diskinit(dfd, 1024, 0, d->length);
+	free(d);
+	if(cachemb != 0)
+		diskcache(dk, (uvlong)cachemb<<20);
+	nubinit(lf, dk, getuser());
+
+	if(debug['R'] == 0)
+		nubreplay();
+	prefetchinit(0);
+	logcommitevery(lf, commitms);
+
+	atexit(nubflush);
+	srvinit(nproc);
+	for(i = 0; i < nlisten; i++)
+		srvlisten(listens[i]);
+
+	/* with only network addresses, post nothing unless asked */
+	if(nlisten == 0 || sflag){
+		if(pipe(pip) < 0)
+			error("can't pipe: %r");
+		srvfd = create(srvfile, OWRITE|ORCLOSE, 0666);
+		if(srvfd < 0)
+			error("can't create %s: %r", srvfile);
+		fprint(srvfd, "%d", pip[1]);
+		close(pip[1]);
+		srvconn(pip[0], 1);
+	}
+	threadexits(nil);
+}
@@ -13,13 +13,43 @@ static Entry*	root;
 static Entry*	altroot;
 static Disk*	disk;
 static LogFile*	thelog;
+static RWLock	sweeplk;	/* see beginchange */
+
+int	inlinemax = 256;	/* files up to this size are kept in the log */
+int	datamode = Ordered;	/* unless a directory says otherwise */
 
 static Dir*	e2d(Entry*);
+static uint	statpack(Entry*, uchar*, uint);
+static void	extentsfree(Entry*);
+static u64int	extentsend(Entry*);
+static u64int	extentend(Entry*, int);
+static int	findextent(Entry*, u64int, u64int*);
+static int	inhole(Entry*, int, u64int);
+static void	behinddiscard(Entry*);
+static void	behindflushall(void);
+static void	datasync(void);
+static int	datamodeof(Entry*);
+static usize	dirread(Fid*, void*, usize, u64int);
+static usize	nubio(Fid*, void*, usize, u64int, int);
+
+static Slab	entryslab = {.name = "Entry", .size = sizeof(Entry)};
+static Slab	fidslab = {.name = "Fid", .size = sizeof(Fid)};
+static Slab	statslab = {.name = "Statbuf", .size = sizeof(Statbuf)};
+static Slab	walkslab = {.name = "Walkqid", .size = sizeof(Walkqid)+MAXWELEM*sizeof(Qid)};
+
+/* counts of metadata, for nubmemstats; also guards allocation of Entry.stat */
+static Lock	memlock;
+static struct {
+	vlong	entries;
+	vlong	extents;
+	vlong	statbufs;
+	vlong	inlinebytes;
+} mem;
 static int accessok(Entry*, String*, uint);
 static int nameexists(Entry*, char*);
 static void checkfilename(char*);
 static int leadseither(String*, String*, char*);
-static void nublog(LogEntry, void*, usize);
+static u64int nublog(LogEntry, void*, usize);
 static void nubnoexcl(Entry*, Fid*);
 static int nubexcl(Entry*, Fid*);
 
@@ -33,7 +63,16 @@ nubinit(LogFile *alog, Disk *adisk, char *uid)
 	altroot = mkentry(nil, "", (Qid){0, 0, QTDIR}, DMDIR|0555, user, user, NOW, 0);
 	ctlinit(altroot, user);
 	usersinit(altroot, user);
+	histinit(altroot, user);
+	traceinit(altroot, user);
 	logsetcopy(thelog, copyentry);
+	logsetsync(thelog, datasync);
+}
+
+static void
+datasync(void)
+{
+	disksync(disk);
 }
 
 void
@@ -42,21 +81,31 @@ nubreplay(void)
 	putpath(root);
 	replayinit(disk);
 	logreplay(thelog, 0, replayentry);	/* swept prefix */
+	replaysynced(~(u64int)0);	/* a sweep syncs the data it copies entries for */
 	logreplay(thelog, 1, replayentry);	/* tail of active */
+	replaycheck();
 	logcomplete(thelog);	/* finish any partial sweep */
 }
 
 void
 nubflush(void)
 {
+	behindflushall();
 	/* could put Mark here, provided replicas can't then diverge */
-	logflush(thelog);
+	logcommit(thelog);
 }
 
 void
 nubsweep(void)
 {
+	wlock(&sweeplk);
+	if(waserror()){
+		wunlock(&sweeplk);
+		raise(nil);
+	}
 	logsweep(thelog);
+	poperror();
+	wunlock(&sweeplk);
 }
 
 Fid*
@@ -95,14 +144,15 @@ walk1(Entry *e, char *name, String *uid)
 		if(f == nil)
 			return e;
 	}else{
-		f = e->files;
-		for(;;){
-			if(f == nil)
-				raise(Enonexist);
-			if(strcmp(f->name, name) == 0)
-				break;
-			f = f->dnext;
-		}
+		qlock(e);
+		f = dirlookup(e, name);
+		if(f != nil)
+			incref(f);
+		qunlock(e);
+		if(f == nil)
+			raise(Enonexist);
+		putentry(e);
+		return f;
 	}
 	incref(f);
 	putentry(e);
@@ -112,33 +162,56 @@ walk1(Entry *e, char *name, String *uid)
 Walkqid*
 nubwalk(Fid *f, Fid *newfid, int nname, char **names)
 {
-	Entry *e;
+	Entry *e, *ents[MAXWELEM];
+	ulong gen[MAXWELEM], ugen;
 	Walkqid *wq;
+	int cache;
 
 	if(f->open >= 0)
 		raise(Emode);
-	wq = emallocz(sizeof(*wq)+nname*sizeof(wq->qid[0]), 1);
+	if(nname > MAXWELEM)
+		raise(Ewalk);
+	wq = slaballoc(&walkslab, 0);
 	wq->clone = nil;
 	wq->nqid = 0;
 	if(waserror()){
-		free(wq);
+		putwalkqid(wq);
 		raise(nil);
 	}
-	e = f->entry;
-	incref(e);
-	if(nname > 0){
+	/* cache walks of several plain names */
+	cache = nname >= 2 && nname <= MAXWELEM;
+	for(int i = 0; cache && i < nname; i++)
+		if(strcmp(names[i], ".") == 0 || strcmp(names[i], "..") == 0)
+			cache = 0;
+	ugen = usersgen();
+	if(cache && (e = walklook(f->entry, f->user, nname, names, wq->qid)) != nil){
+		wq->nqid = nname;
+		cache = 0;
+	}else{
+		e = f->entry;
+		incref(e);
 		for(int i = 0; i < nname; i++){
 			if(waserror()){
+				for(int j = 0; cache && j < i; j++)
+					putentry(ents[j]);
 				if(i == 0)
 					raise(nil);
 				goto Partial;	/* walk partially succeeded */
 			}
+			if(cache)
+				gen[i] = e->wgen;
 			e = walk1(e, names[i], f->user);
 			poperror();
+			if(cache){
+				incref(e);
+				ents[i] = e;
+			}
 			wq->qid[wq->nqid] = e->qid;
 			wq->nqid++;
 		}
 	}
+	if(cache)
+		walkenter(f->entry, f->user, nname, names, ents, gen, ugen);
 	if(newfid != nil && newfid != f){
 		newfid->entry = e;
 		newfid->user = sincref(f->user);
@@ -153,6 +226,12 @@ Partial:
 	return wq;
 }
 
+void
+putwalkqid(Walkqid *wq)
+{
+	slabfree(&walkslab, wq);
+}
+
 Fid*
 nubopen(Fid *f, uint omode)
 {
@@ -183,18 +262,29 @@ nubopen(Fid *f, uint omode)
 		raise(Eperm);
 	if(omode & ORCLOSE && !accessok(e->parent, f->user, DMWRITE))
 		raise(Eperm);
+	beginchange();
+	qlock(e);
+	if(waserror()){
+		qunlock(e);
+		endchange();
+		raise(nil);
+	}
 	if((e->mode & DMEXCL) != 0 && !nubexcl(e, f))
 		raise(Elocked);
 	f->open = omode;
 	if(omode & OTRUNC && (e->mode & DMAPPEND) == 0 && e->io == nil){
 		e->mtime = NOW;
 		setstring(&e->muid, f->user);
+		e->statgen++;
 		if(e->nd != 0 || e->length != 0){
 			truncatefile(e);
 			LogEntry log = {Trunc, e->qid.path, {.trunc={e->mtime, e->cvers, f->user->s}}};
 			nublog(log, nil, 0);
 		}
 	}
+	poperror();
+	qunlock(e);
+	endchange();
 	return f;
 }
 
@@ -209,20 +299,30 @@ nubcreate(Fid *f, char *name, uint omode, u32int perm)
 	if(!accessok(dir, f->user, DMWRITE))
 		raise(Eperm);
 	checkfilename(name);
-	if(nameexists(dir, name))
-		raise(Eexist);
 	if(perm & DMDIR){
 		if(omode & OTRUNC || (omode&3) != OREAD)
 			raise(Eperm);
 		perm &= (~0777 | (dir->mode&0777));
 	}else
 		perm &= (~0666 | (dir->mode&0666));
+	beginchange();
+	qlock(dir);
+	if(waserror()){
+		qunlock(dir);
+		endchange();
+		raise(nil);
+	}
+	if(nameexists(dir, name))
+		raise(Eexist);
 	ne = mkentry(dir, name, (Qid){nextpath(), 0, perm>>24}, perm, f->user, dir->gid, NOW, 0);
 	if(ne == nil)
 		raise(nil);
 	LogEntry log = {Create, dir->qid.path, {
 			.create={ne->qid.path, name, perm, ne->uid->s, ne->gid->s, ne->mtime, ne->cvers}}};
 	nublog(log, nil, 0);
+	poperror();
+	qunlock(dir);
+	endchange();
 	putentry(dir);
 	f->entry = nil;
 	if((ne->mode & DMEXCL) != 0 && !nubexcl(ne, f))
@@ -251,7 +351,7 @@ accessok(Entry *e, String *uid, uint perm)
 	if(strcmp(uid->s, "none") != 0){
 		if(e->uid == uid && ((e->mode>>6)&perm) == perm)
 			return 1;
-		if(ingroup(uid->s, e->gid->s) && ((e->mode>>3)&perm) == perm)
+		if(ingroup(uid, e->gid) && ((e->mode>>3)&perm) == perm)
 			return 1;
 	}
 	if((e->mode&perm) == perm)
@@ -261,6 +361,444 @@ accessok(Entry *e, String *uid, uint perm)
 	return 0;
 }
 
+/*
+ * write zeros to the space allocated to e between from and to,
+ * which a write is about to bring into the file: the tail of
+ * an extent past the end, or of an extent that filled a hole.
+ * e is locked.
+ */
+static void
+zeroextents(Entry *e, u64int from, u64int to)
+{
+	u64int eoff, end;
+	int j;
+
+	while(from < to){
+		j = findextent(e, from, &eoff);
+		if(j == e->nd)
+			break;
+		if(inhole(e, j, from)){
+			from = e->start[e->order[j]];
+			continue;
+		}
+		end = extentend(e, j);
+		if(end > to)
+			end = to;
+		diskzero(disk, end-from, e->data[e->order[j]].base+eoff);
+		from = end;
+	}
+}
+
+/*
+ * write to e's extents, allocating more as needed; e is locked.
+ * the data for up to Nvec extents goes to disk in one batch,
+ * then each piece is logged.
+ * if flushable, a flush can cut the write short.
+ */
+static usize
+writeextents(Entry *e, uchar *a, usize count, u64int offset, int flushable)
+{
+	u64int extoffset, end, size;
+	usize n;
+	int i, j, nv, wb;
+	uchar *p;
+	int newext;
+	char *err;
+	Extent ext;
+	Diskvec v[Nvec];
+	LogEntry log[Nvec];
+
+	p = a;
+	err = nil;
+	wb = datamodeof(e) == Writeback;
+	if(offset > e->length)
+		zeroextents(e, e->length, offset);
+	while(count != 0 && err == nil){
+		if(flushable && interrupted()){
+			if(p == a)
+				raise(Eflushed);
+			break;	/* report what was written */
+		}
+		for(nv = 0; nv < Nvec && count != 0; nv++){
+			j = findextent(e, offset, &extoffset);
+			n = count;
+			if(!inhole(e, j, offset)){
+				/* still space */
+				end = extentend(e, j);
+				if(offset+n > end)
+					n = end - offset;
+				i = e->order[j];
+				ext = e->data[i];
+				newext = 0;
+			}else{
+				/* allocate new space: at the end, or to fill a hole */
+				end = extentsend(e);
+				if(j < e->nd){
+					if(offset+n > e->start[e->order[j]])
+						n = e->start[e->order[j]] - offset;
+					end = 0;
+				}
+				if(n > Maxextent)
+					n = Maxextent;
+				size = extentsize(disk, n, end, e->nd);
+				if(size == 0){
+					err = Efilesize;
+					break;
+				}
+				ext = allocdisk(disk, size);
+				if(ext.length == 0){
+					err = Efull;
+					break;
+				}
+				if(n > ext.length)
+					n = ext.length;
+				i = e->nd;
+				if(waserror()){
+					freedisk(disk, ext);
+					raise(nil);
+				}
+				addextent(e, ext, offset);
+				poperror();
+				newext = NewExtent;
+				if(j+1 < e->nd)
+					zeroextents(e, offset+n, extentend(e, j));
+			}
+			v[nv] = (Diskvec){p, n, ext.base+extoffset};
+			log[nv] = (LogEntry){Write, e->qid.path, {.write={e->mtime, e->muid->s, offset, n, 0, e->cvers, extoffset, ext, i | newext, 0}}};
+			if(wb)
+				log[nv].write.sum = datasum(p, n);
+			offset += n;
+			p += n;
+			count -= n;
+		}
+		diskwritev(disk, v, nv);
+		for(j = 0; j < nv; j++){
+			log[j].write.vers = ++e->qid.vers;
+			nublog(log[j], v[j].p, v[j].n);
+			if(log[j].write.offset+v[j].n > e->length)
+				e->length = log[j].write.offset+v[j].n;
+		}
+		e->statgen++;
+	}
+	if(err != nil)
+		raise(err);
+	return p-a;
+}
+
+/*
+ * the data mode set by e's nearest directory, if any
+ */
+static int
+datamodeof(Entry *e)
+{
+	Entry *d;
+
+	for(d = e->parent; d != nil; d = d->parent)
+		if(d->dmode != 0)
+			return d->dmode;
+	return datamode;
+}
+
+/*
+ * set the data mode for files below the directory with the given path name
+ * (0 to inherit)
+ */
+void
+nubdatamode(char *path, int mode)
+{
+	char *names[64], *p;
+	Entry *d, *x;
+	int i, n;
+
+	p = estrdup(path);
+	beginchange();
+	if(waserror()){
+		endchange();
+		free(p);
+		raise(nil);
+	}
+	n = getfields(p, names, nelem(names), 1, "/");
+	d = root;
+	incref(d);
+	for(i = 0; i < n; i++){
+		if(*names[i] == 0)
+			continue;
+		qlock(d);
+		x = dirlookup(d, names[i]);
+		if(x != nil)
+			incref(x);
+		qunlock(d);
+		putentry(d);
+		if(x == nil)
+			raise(Enonexist);
+		d = x;
+	}
+	if((d->mode & DMDIR) == 0){
+		putentry(d);
+		raise(Enotdir);
+	}
+	qlock(d);
+	if(waserror()){
+		qunlock(d);
+		putentry(d);
+		raise(nil);
+	}
+	LogEntry log = {Datamode, d->qid.path, {.datamode={mode}}};
+	nublog(log, nil, 0);
+	d->dmode = mode;
+	poperror();
+	qunlock(d);
+	putentry(d);
+	poperror();
+	endchange();
+	free(p);
+}
+
+/*
+ * a small file keeps its contents in the Entry and, whole, in an Inline log entry:
+ * no disk space and no data write. it moves to extents when it outgrows inlinemax.
+ */
+static usize
+writeinline(Entry *e, uchar *a, usize count, u64int offset)
+{
+	uchar *d;
+	usize n;
+
+	n = e->length;
+	if(offset+count > n)
+		n = offset+count;
+	d = emallocz(n, 0);
+	if(e->idata != nil)
+		memmove(d, e->idata, e->length);
+	if(offset > e->length)
+		memset(d+e->length, 0, offset-e->length);
+	memmove(d+offset, a, count);
+	LogEntry log = {Inline, e->qid.path, {.inl={e->mtime, e->muid->s, e->cvers, n, d}}};
+	if(waserror()){
+		free(d);
+		raise(nil);
+	}
+	e->iseq = nublog(log, d, n);
+	poperror();
+	inlineset(e, d, n);
+	e->length = n;
+	e->qid.vers++;
+	e->statgen++;
+	return count;
+}
+
+/*
+ * move a small file's contents to extents, before it grows
+ */
+static void
+promote(Entry *e)
+{
+	uchar *d;
+	usize n;
+
+	d = e->idata;
+	n = e->length;
+	e->length = 0;
+	if(waserror()){
+		e->length = n;
+		raise(nil);
+	}
+	writeextents(e, d, n, 0, 0);
+	poperror();
+	inlineset(e, nil, 0);
+}
+
+/*
+ * write-behind
+ *
+ * small writes that follow on from each other, within a file's
+ * existing extents or appending past them, are gathered in a buffer
+ * for the file, then written and logged together: when the buffer
+ * reaches the end of its extent or Maxbehind, when a write does not
+ * follow on, and on read, clunk, sync-wstat and nubflush.
+ * an overwrite has its space already, so only an i/o error can be
+ * reported late; an append gets its space when the buffer is written,
+ * in extents sized for the whole buffer, so a full disk can be too.
+ * buffered files are listed, and referenced, for nubflush.
+ * past Maxdirty in all, writes go straight to disk.
+ */
+
+enum{
+	Maxbehind=	256*1024,
+	Maxdirty=	16*1024*1024,
+};
+
+struct Wbuf {
+	u64int	off;	/* file offset of buf[0] */
+	usize	n;
+	usize	max;	/* to the end of the extent, at most Maxbehind; Maxbehind for an append */
+	usize	size;	/* of buf */
+	uchar*	buf;
+	Entry*	e;
+	Wbuf*	next;	/* in behind.head */
+	Wbuf*	prev;
+};
+
+static struct {
+	Lock;
+	Wbuf*	head;
+	long	bytes;
+} behind;
+
+static void
+behindunlist(Wbuf *w)
+{
+	lock(&behind);
+	if(w->prev != nil)
+		w->prev->next = w->next;
+	else
+		behind.head = w->next;
+	if(w->next != nil)
+		w->next->prev = w->prev;
+	behind.bytes -= w->n;
+	unlock(&behind);
+}
+
+/* e is locked */
+static void
+behinddiscard(Entry *e)
+{
+	Wbuf *w;
+
+	if((w = e->wb) == nil)
+		return;
+	e->wb = nil;
+	behindunlist(w);
+	free(w->buf);
+	free(w);
+	decref(e);	/* the list's; the caller has another */
+}
+
+/*
+ * write out e's buffer, if any; e is locked, within a change.
+ * on error the buffer is kept, to be tried again.
+ */
+void
+behindflush(Entry *e)
+{
+	Wbuf *w;
+
+	if((w = e->wb) == nil)
+		return;
+	if(w->n != 0)
+		writeextents(e, w->buf, w->n, w->off, 0);
+	behinddiscard(e);
+}
+
+/*
+ * buffer the write if possible; e is locked
+ */
+static int
+behindwrite(Entry *e, uchar *a, usize count, u64int offset)
+{
+	Wbuf *w;
+	u64int eoff, end;
+	usize max;
+	uchar *b;
+	int j;
+
+	max = 0;
+	w = e->wb;
+	if(w != nil && (offset != w->off+w->n || w->n+count > w->max)){
+		behindflush(e);
+		w = nil;
+	}
+	if(w == nil){
+		if(offset > e->length)
+			return 0;	/* writeextents clears the gap */
+		end = extentsend(e);
+		if(offset < end){
+			if(offset+count > end)
+				return 0;
+			j = findextent(e, offset, &eoff);
+			if(inhole(e, j, offset))
+				return 0;
+			max = extentend(e, j) - offset;
+			if(max > Maxbehind)
+				max = Maxbehind;
+		}else if(offset == end && e->nd < Nextent)
+			max = Maxbehind;	/* append */
+		else
+			return 0;
+		if(count >= max)
+			return 0;	/* as well write it now */
+	}
+	lock(&behind);
+	if(behind.bytes+count > Maxdirty){
+		unlock(&behind);
+		return 0;
+	}
+	behind.bytes += count;
+	if(w == nil){
+		w = emallocz(sizeof(*w), 1);
+		w->off = offset;
+		w->max = max;
+		w->e = e;
+		incref(e);
+		e->wb = w;
+		w->next = behind.head;
+		if(behind.head != nil)
+			behind.head->prev = w;
+		behind.head = w;
+	}
+	unlock(&behind);
+	if(w->n+count > w->size){
+		w->size = w->size == 0? 4*count: 2*w->size;
+		if(w->size < w->n+count)
+			w->size = w->n+count;
+		if(w->size > w->max)
+			w->size = w->max;
+		b = emallocz(w->size, 0);
+		memmove(b, w->buf, w->n);
+		free(w->buf);
+		w->buf = b;
+	}
+	memmove(w->buf+w->n, a, count);
+	w->n += count;
+	e->qid.vers++;
+	e->statgen++;
+	if(offset+count > e->length)
+		e->length = offset+count;
+	if(w->n == w->max)
+		behindflush(e);
+	return 1;
+}
+
+static void
+behindflushall(void)
+{
+	Entry *e;
+
+	for(;;){
+		lock(&behind);
+		if(behind.head == nil){
+			unlock(&behind);
+			break;
+		}
+		e = behind.head->e;
+		incref(e);
+		unlock(&behind);
+		beginchange();
+		qlock(e);
+		if(waserror()){
+			/* don't try for ever */
+			fprint(2, "nubfs: write-behind of %q lost: %r\n", e->name->s);
+			behinddiscard(e);
+		}else{
+			behindflush(e);
+			poperror();
+		}
+		qunlock(e);
+		endchange();
+		putentry(e);
+	}
+}
+
 /*
  * for writes, one could choose to use strict logging (no overwrites),
  * overwrite, or a mixture (overwrite until close, then it's immutable).
@@ -271,139 +809,279 @@ usize
 nubwrite(Fid *f, void *a, usize count, u64int offset)
 {
 	Entry *e;
-	u64int extoffset, cap;
 	usize n;
-	int i;
-	uchar *p;
-	int newext;
-	Extent ext;
 
 	e = f->entry;
 	if(e->qid.type & QTDIR)
 		raise(Eperm);	/* should be detected earlier */
+	if(e->io != nil)
+		return nubio(f, a, count, offset, 1);
+	beginchange();
+	qlock(e);
+	if(waserror()){
+		qunlock(e);
+		endchange();
+		raise(nil);
+	}
 	if(e->excl != nil && !nubexcl(e, f))
 		raise(Elockbroken);
-	if(count == 0)
+	if(count == 0){
+		poperror();
+		qunlock(e);
+		endchange();
 		return 0;
+	}
 	if(e->qid.type & QTAPPEND)
 		offset = e->length;
 	e->mtime = NOW;
-	if(e->io != nil)
-		return e->io(f, a, count, offset, 1);
-	p = a;
-	cap = 0;
-	extoffset = offset;
-	for(i = 0; i < e->nd; i++){
-		if(extoffset < e->data[i].length)
-			break;
-		extoffset -= e->data[i].length;
-		cap += e->data[i].length;
-	}
-	while(count != 0){
-		if(i < e->nd){
-			/* still space */
+	e->statgen++;
+	if(e->nd == 0 && (e->idata != nil || e->length == 0) && offset+count <= inlinemax)
+		n = writeinline(e, a, count, offset);
+	else{
+		if(e->idata != nil)
+			promote(e);
+		if(behindwrite(e, a, count, offset))
 			n = count;
-			if(extoffset+n > e->data[i].length)
-				n = e->data[i].length - extoffset;
-			ext = e->data[i];
-			newext = 0;
-		}else{
-			/* allocate new space */
-			n = extentsize(disk, extoffset+count, cap, i);
-			if(n == 0)
-				raise(Efilesize);
-			ext = allocdisk(disk, n);
-			n = ext.length;
-			if(n == 0)
-				raise(Efull);
-			if(n > count)
-				n = count;
-			e->data[e->nd++] = ext;
-			newext = NewExtent;
-			extoffset = 0;
+		else{
+			behindflush(e);
+			n = writeextents(e, a, count, offset, 1);
 		}
-		cap += e->data[i].length;
-		e->qid.vers++;
-		diskwrite(disk, p, n, e->data[i].base+extoffset);
-		LogEntry log = {Write, e->qid.path, {.write={e->mtime, e->muid->s, offset, n, e->qid.vers, e->cvers, extoffset, ext, i | newext}}};
-		nublog(log, p, n);
-		if((offset += n) > e->length)
-			e->length = offset;
-		extoffset = 0;
-		p += n;
-		count -= n;
-		i++;
 	}
-	return p-(uchar*)a;
+	poperror();
+	qunlock(e);
+	endchange();
+	return n;
+}
+
+/*
+ * generated files, such as ctl, look after themselves:
+ * they aren't logged, and a ctl write can sweep or flush,
+ * so e->io is called without e locked
+ */
+static usize
+nubio(Fid *f, void *a, usize count, u64int offset, int write)
+{
+	Entry *e;
+
+	e = f->entry;
+	qlock(e);
+	if(e->excl != nil && !nubexcl(e, f)){
+		qunlock(e);
+		raise(Elockbroken);
+	}
+	if(write){
+		e->mtime = NOW;
+		e->statgen++;
+	}else
+		e->atime = NOW;
+	qunlock(e);
+	if(write && count == 0)
+		return 0;
+	return e->io(f, a, count, offset, write);
+}
+
+/*
+ * transfer size to advertise for f, at most max.
+ * extents are power-of-two multiples of the sector size,
+ * and extentsize gives each new extent at least the size of the write,
+ * so a power-of-two unit no larger than that keeps
+ * aligned reads and writes within a single extent
+ * (but for extents that filled holes, which start where their write did).
+ */
+u32int
+nubiounit(Fid *f, u32int max)
+{
+	Entry *e;
+	u32int n;
+
+	e = f->entry;
+	if(e->qid.type & QTDIR || e->io != nil)
+		return max;
+	n = extentsize(disk, max, e->length, e->nd);
+	if(n == 0)
+		return max;	/* no more extents; let nubwrite say so */
+	while(n > max)
+		n >>= 1;
+	if(n < secsize(disk))
+		return max;
+	return n;
 }
 
 usize
 nubread(Fid *f, void *a, usize count, u64int offset)
 {
-	Entry *e, *x;
-	Dir *dir;
-	u64int off;
+	Entry *e;
 	usize n;
-	int i;
-	uchar *p;
 
 	if(f->open < 0)
 		raise(Eopen);
 	if((f->open&3) == OWRITE)
 		raise(Eaccess);
 	e = f->entry;
+	if(e->qid.type & QTDIR)
+		return dirread(f, a, count, offset);
+	if(e->io != nil)
+		return nubio(f, a, count, offset, 0);
+	beginchange();	/* readextents might write out write-behind */
+	qlock(e);
+	if(waserror()){
+		qunlock(e);
+		endchange();
+		raise(nil);
+	}
+	if(e->excl != nil && !nubexcl(e, f))
+		raise(Elockbroken);
+	e->atime = NOW;
+	n = 0;
+	if(count != 0 && offset < e->length){
+		if(offset+count > e->length)
+			count = e->length - offset;
+		if(e->idata != nil){
+			memmove(a, e->idata+offset, count);
+			n = count;
+		}else{
+			n = readahead(f, a, count, offset);
+			if(n < count)
+				n += readextents(e, (uchar*)a+n, count-n, offset+n);
+			readaheadnext(f, offset, n);
+		}
+	}
+	poperror();
+	qunlock(e);
+	endchange();
+	return n;
+}
+
+/*
+ * sequential reads carry on from the fid's cursor,
+ * unless the directory has changed since;
+ * otherwise entries must be counted from the start.
+ */
+static usize
+dirread(Fid *f, void *a, usize count, u64int offset)
+{
+	Entry *e, *x;
+	u64int off;
+	usize n;
+	uchar *p;
+
+	e = f->entry;
+	qlock(e);
+	if(waserror()){
+		qunlock(e);
+		raise(nil);
+	}
 	if(e->excl != nil && !nubexcl(e, f))
 		raise(Elockbroken);
 	e->atime = NOW;
 	p = a;
-	if(e->qid.type & QTDIR){
+	if(offset != 0 && offset == f->diroff && f->dirvers == e->qid.vers){
+		x = f->dirent;
+		off = offset;
+	}else{
 		off = 0;
-		for(x = e->files; x != nil && count != 0; x = x->dnext){
-			dir = e2d(x);
-			n = sizeD2M(dir);
-			if(off < offset){
-				free(dir);
-				off += n;
-				continue;
-			}
-			if(count < n){
-				free(dir);
-				break;
-			}
-			n = convD2M(dir, p, count);
-			free(dir);
-			count -= n;
-			p += n;
+		for(x = e->files; x != nil && off < offset; x = x->dnext)
+			off += statpack(x, nil, 0);
+	}
+	for(; x != nil && count != 0; x = x->dnext){
+		if(interrupted()){
+			if(p == a)
+				raise(Eflushed);
+			break;
 		}
-		return p-(uchar*)a;
+		n = statpack(x, p, count);
+		if(n > count)
+			break;
+		count -= n;
+		p += n;
+		off += n;
 	}
-	if(e->io != nil)
-		return e->io(f, a, count, offset, 0);
-	if(count == 0 || offset > e->length)
-		return 0;
-	if(offset+count > e->length)
-		count = e->length - offset;
-	for(i = 0; i < e->nd; i++){
-		if(offset < e->data[i].length)
+	if(x != nil)
+		incref(x);
+	putentry(f->dirent);
+	f->dirent = x;
+	f->diroff = off;
+	f->dirvers = e->qid.vers;
+	poperror();
+	qunlock(e);
+	return p-(uchar*)a;
+}
+
+/*
+ * read count bytes at offset from e's extents; e is locked,
+ * within a change (write-behind is written out first),
+ * and the range is within the file.
+ * the data for up to Nvec extents is read in one batch.
+ */
+usize
+readextents(Entry *e, uchar *a, usize count, u64int offset)
+{
+	usize n, tot;
+	int nv;
+	Diskvec v[Nvec];
+
+	behindflush(e);
+	for(tot = 0; tot < count; tot += n){
+		nv = extentvec(e, a+tot, count-tot, offset+tot, v, Nvec, &n);
+		if(n == 0)
+			break;
+		if(interrupted()){
+			if(tot == 0)
+				raise(Eflushed);
 			break;
-		offset -= e->data[i].length;
+		}
+		diskreadv(disk, v, nv);
 	}
-	for(; i < e->nd && count != 0; i++){
+	return tot;
+}
+
+/*
+ * where on disk count bytes at offset in e are, as at most nv pieces
+ * to be read into a; returns the number of pieces, with the bytes
+ * they cover in *np. holes are zeroed in a on the way.
+ * e is locked and its write-behind written out.
+ * the pieces can be read once e is unlocked (nubreadv), if the
+ * caller then checks that qid.vers has not changed.
+ */
+int
+extentvec(Entry *e, uchar *a, usize count, u64int offset, Diskvec *v, int nv, usize *np)
+{
+	u64int eoff;
+	usize n;
+	int j, k;
+
+	*np = 0;
+	k = 0;
+	while(count != 0 && k < nv){
+		j = findextent(e, offset, &eoff);
 		n = count;
-		if(offset + n > e->data[i].length)
-			n = e->data[i].length - offset;
-		diskread(disk, p, n, e->data[i].base+offset);
-		offset = 0;
+		if(inhole(e, j, offset)){
+			if(j < e->nd && offset+n > e->start[e->order[j]])
+				n = e->start[e->order[j]] - offset;
+			memset(a, 0, n);
+		}else{
+			if(offset+n > extentend(e, j))
+				n = extentend(e, j) - offset;
+			v[k++] = (Diskvec){a, n, e->data[e->order[j]].base+eoff};
+		}
+		offset += n;
 		count -= n;
-		p += n;
+		a += n;
+		*np += n;
 	}
-	return p-(uchar*)a;
+	return k;
+}
+
+void
+nubreadv(Diskvec *v, int nv)
+{
+	diskreadv(disk, v, nv);
 }
 
 void
 nubremove(Fid *f)
 {
-	Entry *e, *p, **l;
+	Entry *e, *p;
 
 	if(waserror()){
 		nubclunk(f);
@@ -412,36 +1090,49 @@ nubremove(Fid *f)
 	e = f->entry;
 	if(e->parent == nil)
 		raise(Eperm);
+	p = e->parent;
+	beginchange();
+	qlock(p);	/* parent before child */
+	qlock(e);
+	if(waserror()){
+		qunlock(e);
+		qunlock(p);
+		endchange();
+		raise(nil);
+	}
 	if(e->qid.type & QTDIR){
 		if(e->files != nil)
 			raise(Enotempty);
 	}
-	p = e->parent;
-	if((p->qid.type & QTDIR) == 0)
-		raise(Ephase);
-	for(l = &p->files; *l != nil && *l != e; l = &(*l)->dnext){
-		/* skip */
-	}
-	if(*l == nil)
+	if((p->qid.type & QTDIR) == 0 || e->parent != p)
 		raise(Ephase);
-	*l = e->dnext;
+	dirunlink(e);
 	putentry(e);	/* directory entry */
 	if((e->qid.type & QTDIR) == 0)
 		truncatefile(e);
 	p->mtime = NOW;
+	p->qid.vers++;
 	setstring(&p->muid, f->user);
+	p->statgen++;
 	LogEntry log = {Remove, e->qid.path, {.remove={p->mtime, p->muid->s}}};
 	nublog(log, nil, 0);
 	lookpath(e->qid.path, 1);
-//print("e %q ref %ld\n", e->name, e->ref);
+//print("e %q ref %ld\n", e->name->s, e->ref);
+	poperror();
+	qunlock(e);
+	qunlock(p);
+	endchange();
 	poperror();
 	nubclunk(f);
 }
 
-Dir*
-nubstat(Fid *f)
+/*
+ * pack f's stat into buf, if it fits in nbuf bytes; return its size
+ */
+uint
+nubstat(Fid *f, uchar *buf, uint nbuf)
 {
-	return e2d(f->entry);
+	return statpack(f->entry, buf, nbuf);
 }
 
 void
@@ -449,6 +1140,7 @@ nubsync(Fid *f)
 {
 	LogEntry log = {Sync, f->entry->qid.path};
 	nublog(log, nil, 0);
+	logcommit(thelog);
 }
 
 void
@@ -461,8 +1153,19 @@ nubwstat(Fid *f, Dir *d)
 	if(strcmp(f->user->s, "none") == 0)
 		raise(Eperm);
 	e = f->entry;
+	beginchange();
+	if(e->parent != nil)
+		qlock(e->parent);	/* parent before child */
+	qlock(e);
+	if(waserror()){
+		qunlock(e);
+		if(e->parent != nil)
+			qunlock(e->parent);
+		endchange();
+		raise(nil);
+	}
 	dosync = 1;
-	if(d->name != nil && *d->name != 0 && strcmp(d->name, e->name) != 0){	/* change name (write permission in parent) */
+	if(d->name != nil && *d->name != 0 && strcmp(d->name, e->name->s) != 0){	/* change name (write permission in parent) */
 		checkfilename(d->name);
 		if(!accessok(e->parent, f->user, DMWRITE) && !wstatallow)
 			raise(Eperm);
@@ -513,6 +1216,13 @@ nubwstat(Fid *f, Dir *d)
 		dosync = 0;
 	}
 	if(dosync){	/* sync-wstat */
+		if((e->qid.type & QTDIR) == 0)
+			behindflush(e);
+		poperror();
+		qunlock(e);
+		if(e->parent != nil)
+			qunlock(e->parent);
+		endchange();
 		nubsync(f);
 		return;
 	}
@@ -520,10 +1230,8 @@ nubwstat(Fid *f, Dir *d)
 		e->mode = d->mode;
 		e->qid.type = d->mode>>24;
 	}
-	if(d->name != nil && *d->name != 0 && strcmp(d->name, e->name) != 0){
-		free(e->name);
-		e->name = estrdup(d->name);
-	}
+	if(d->name != nil && *d->name != 0 && strcmp(d->name, e->name->s) != 0)
+		dirrename(e, d->name);
 	if(d->uid != nil && *d->uid != 0 && strcmp(d->uid, e->uid->s) != 0){
 		putstring(e->uid);
 		e->uid = name2uid(d->uid);
@@ -532,8 +1240,16 @@ nubwstat(Fid *f, Dir *d)
 		putstring(e->gid);
 		e->gid = name2uid(d->gid);
 	}
-	if(e->io != nil)
+	if(e->qid.type & QTDIR)
+		walkstale(e);	/* permission to walk it might have changed */
+	if((e->mode & DMDIR) == 0 && e->io != nil){
+		poperror();
+		qunlock(e);
+		if(e->parent != nil)
+			qunlock(e->parent);
+		endchange();
 		return;
+	}
 	if(d->length == 0 && e->length != 0){
 		truncatefile(e);
 		LogEntry log = {Trunc, e->qid.path, {.trunc={e->mtime, e->cvers, f->user->s}}};
@@ -541,8 +1257,14 @@ nubwstat(Fid *f, Dir *d)
 	}
 	if(d->mtime != ~0)
 		e->mtime = d->mtime;
+	e->statgen++;
 	LogEntry log = {Wstat, e->qid.path, {.wstat = {d->mode, d->name, d->uid, d->gid, e->muid->s, e->mtime, e->atime}}};
 	nublog(log, nil, 0);
+	poperror();
+	qunlock(e);
+	if(e->parent != nil)
+		qunlock(e->parent);
+	endchange();
 }
 
 static int
@@ -559,6 +1281,7 @@ void
 nubclunk(Fid *f)
 {
 	Entry *e;
+	int omode, flush;
 
 	if(f == nil)
 		return;
@@ -573,10 +1296,29 @@ nubclunk(Fid *f)
 		}
 	}
 	e = f->entry;
+	omode = f->open;
 	f->open = -1;
 	f->entry = nil;
+	putentry(f->dirent);
+	f->dirent = nil;
+	free(f->snap);
+	f->snap = nil;
+	flush = omode >= 0 && (omode&3) != OREAD && (e->qid.type & QTDIR) == 0;
+	if(flush)
+		beginchange();
+	qlock(e);
+	if(flush){
+		/* errors ignored, as above; the buffer stays for nubflush */
+		if(!waserror()){
+			behindflush(e);
+			poperror();
+		}
+	}
 	if(e->excl != nil)
 		nubnoexcl(e, f);
+	qunlock(e);
+	if(flush)
+		endchange();
 	putentry(e);
 }
 
@@ -616,18 +1358,17 @@ e2d(Entry *e)
 	u = nameofuid(e->uid);
 	g = nameofuid(e->gid);
 	m = nameofuid(e->muid);
-	d = emallocz(sizeof(*d)+strlen(u->s)+strlen(g->s)+strlen(m->s)+strlen(e->name)+4, 0);
+	d = emallocz(sizeof(*d)+strlen(u->s)+strlen(g->s)+strlen(m->s)+e->name->n+4, 0);
 	p = (char*)d+sizeof(*d);
 	d->type = 0;
 	d->dev = 0;
-	d->name = appstr(&p, e->name);
+	d->name = appstr(&p, e->name->s);
 	d->uid = appstr(&p, u->s);
 	putstring(u);
 	d->gid = appstr(&p, g->s);
 	putstring(g);
 	d->muid = appstr(&p, m->s);
 	putstring(m);
-	d->name = e->name;
 	d->mtime = e->mtime;
 	d->mode = e->mode;
 	d->atime = e->mtime;
@@ -641,6 +1382,65 @@ e2d(Entry *e)
 	return d;
 }
 
+/*
+ * copy e's packed stat to buf, if it fits in nbuf bytes, and return its size.
+ * the packed form is kept with the entry, and made again, with e locked,
+ * once e->statgen or the user table has moved on.
+ * the caller must not hold e's lock: a directory read holds only the parent's.
+ */
+static uint
+statpack(Entry *e, uchar *buf, uint nbuf)
+{
+	Statbuf *s;
+	Dir *d;
+	ulong gen, ugen;
+	uint n;
+
+	if(e->stat == nil){
+		lock(&memlock);
+		if(e->stat == nil){
+			e->stat = slaballoc(&statslab, 1);
+			mem.statbufs++;
+		}
+		unlock(&memlock);
+	}
+	s = e->stat;
+	ugen = usersgen();
+	lock(s);
+	if(s->buf == nil || s->gen != e->statgen || s->usersgen != ugen){
+		unlock(s);
+		qlock(e);
+		gen = e->statgen;
+		d = e2d(e);
+		qunlock(e);
+		n = sizeD2M(d);
+		lock(s);
+		free(s->buf);
+		s->buf = emallocz(n, 0);
+		s->n = convD2M(d, s->buf, n);
+		free(d);
+		s->gen = gen;
+		s->usersgen = ugen;
+	}
+	n = s->n;
+	if(buf != nil && n <= nbuf)
+		memmove(buf, s->buf, n);
+	unlock(s);
+	return n;
+}
+
+static void
+statfree(Statbuf *s)
+{
+	if(s == nil)
+		return;
+	free(s->buf);
+	slabfree(&statslab, s);
+	lock(&memlock);
+	mem.statbufs--;
+	unlock(&memlock);
+}
+
 /*
  * locks
  */
@@ -684,57 +1484,209 @@ nubnoexcl(Entry *e, Fid *f)
  * fids
  */
 
+/*
+ * walks make and clunk Fids at a great rate, so they come from a slab
+ */
 Fid*
 mkfid(u32int fid, String *user)
 {
 	Fid *f;
 
-	f = emallocz(sizeof(*f), 0);
+	f = slaballoc(&fidslab, 1);
+	f->ref = 1;
 	f->fid = fid;
 	f->open = -1;
 	f->entry = nil;
 	f->user = sincref(user);
-	f->next = nil;
 	return f;
 }
 
 void
 putfid(Fid *f)
 {
-	if(f == nil)
+	if(f == nil || decref(f) != 0)
 		return;
 	putstring(f->user);
 	putentry(f->entry);
-	free(f);
+	putentry(f->dirent);
+	free(f->snap);
+	readaheadfree(f->ra);
+	slabfree(&fidslab, f);
+}
+
+/*
+ * the text of a generated file such as users, made afresh when
+ * read at offset 0 and kept with the fid for the reads that follow.
+ * f is locked by the request.
+ */
+char*
+fidsnap(Fid *f, u64int offset, char *(*gen)(void))
+{
+	if(offset == 0 || f->snap == nil){
+		free(f->snap);
+		f->snap = nil;
+		f->snap = gen();
+	}
+	return f->snap;
 }
 
 /*
  * entries
+ *
+ * an Entry's lock protects its contents, its directory list and its excl;
+ * a parent is always locked before its child.
  */
 
 static int
 nameexists(Entry *dir, char *name)
 {
+	return dirlookup(dir, name) != nil;
+}
+
+/*
+ * directory lists
+ *
+ * a directory's files are doubly linked in order of creation,
+ * for reading; once there are more than Dirhashmin of them,
+ * a hash table on the name is kept as well, doubled as needed.
+ * called with the directory locked, or during replay.
+ */
+
+static void
+dirhashadd(Dirhash *h, Entry *e)
+{
+	Entry **l;
+
+	l = &h->tab[e->name->hash&(h->n-1)];
+	e->hnext = *l;
+	*l = e;
+}
+
+static void
+dirhashdel(Dirhash *h, Entry *e)
+{
+	Entry **l;
+
+	for(l = &h->tab[e->name->hash&(h->n-1)]; *l != nil; l = &(*l)->hnext)
+		if(*l == e){
+			*l = e->hnext;
+			break;
+		}
+	e->hnext = nil;
+}
+
+static void
+dirhashbuild(Entry *dir, uint n)
+{
+	Dirhash *h;
 	Entry *e;
 
-	for(e = dir->files; e != nil; e = e->dnext){
-		if(strcmp(e->name, name) == 0)
-			return 1;
+	h = dir->hash;
+	if(h == nil){
+		h = emallocz(sizeof(*h), 1);
+		dir->hash = h;
+	}else
+		free(h->tab);
+	h->n = n;
+	h->tab = emallocz(n*sizeof(*h->tab), 1);
+	for(e = dir->files; e != nil; e = e->dnext)
+		dirhashadd(h, e);
+}
+
+Entry*
+dirlookup(Entry *dir, char *name)
+{
+	Entry *e;
+	uint h;
+
+	h = hashstr(name);
+	if(dir->hash != nil){
+		for(e = dir->hash->tab[h&(dir->hash->n-1)]; e != nil; e = e->hnext)
+			if(e->name->hash == h && strcmp(e->name->s, name) == 0)
+				return e;
+		return nil;
 	}
-	return 0;
+	for(e = dir->files; e != nil; e = e->dnext)
+		if(e->name->hash == h && strcmp(e->name->s, name) == 0)
+			return e;
+	return nil;
+}
+
+/* add e at the end of dir, so that directory reading sees files in order */
+static void
+dirlink(Entry *dir, Entry *e)
+{
+	e->dnext = nil;
+	e->dprev = dir->lastfile;
+	if(dir->lastfile != nil)
+		dir->lastfile->dnext = e;
+	else
+		dir->files = e;
+	dir->lastfile = e;
+	dir->nfiles++;
+	walkstale(dir);
+	if(dir->hash != nil){
+		if(dir->nfiles > 2*dir->hash->n)
+			dirhashbuild(dir, 2*dir->hash->n);
+		else
+			dirhashadd(dir->hash, e);
+	}else if(dir->nfiles > Dirhashmin)
+		dirhashbuild(dir, 2*Dirhashmin);
+}
+
+/* remove e from its parent's list; the caller drops the list's reference */
+void
+dirunlink(Entry *e)
+{
+	Entry *dir;
+
+	dir = e->parent;
+	if(dir->hash != nil)
+		dirhashdel(dir->hash, e);
+	if(e->dprev != nil)
+		e->dprev->dnext = e->dnext;
+	else
+		dir->files = e->dnext;
+	if(e->dnext != nil)
+		e->dnext->dprev = e->dprev;
+	else
+		dir->lastfile = e->dprev;
+	e->dnext = e->dprev = nil;
+	dir->nfiles--;
+	walkstale(dir);
+}
+
+void
+dirrename(Entry *e, char *name)
+{
+	Dirhash *h;
+
+	h = nil;
+	if(e->parent != nil){
+		e->parent->qid.vers++;	/* offsets of later entries change */
+		e->parent->statgen++;
+		h = e->parent->hash;
+		walkstale(e->parent);
+	}
+	if(h != nil)
+		dirhashdel(h, e);
+	putstring(e->name);
+	e->name = string(name);
+	e->statgen++;
+	if(h != nil)
+		dirhashadd(h, e);
 }
 
 Entry*
 mkentry(Entry *parent, char *name, Qid qid, u32int perm, String *uid, String *gid, u32int mtime, u32int cvers)
 {
-	Entry *e, **lp;
+	Entry *e;
 
 	qid.type = perm>>24;
-	e = emallocz(sizeof(*e), 0);
-	setmalloctag(e, getcallerpc(&parent));
+	e = slaballoc(&entryslab, 0);
 	e->ref = 1;
 	e->qid = qid;
-	e->name = estrdup(name);
+	e->name = string(name);
 	e->mode = perm;
 	e->uid = sincref(uid);
 	e->gid = sincref(gid);
@@ -745,22 +1697,39 @@ mkentry(Entry *parent, char *name, Qid qid, u32int perm, String *uid, String *gi
 		e->cvers = cvers;
 		e->length = 0;
 		e->nd = 0;
+		e->nalloc = 0;
+		e->data = nil;
+		e->start = nil;
+		e->order = nil;
+		e->idata = nil;
+		e->iseq = 0;
+		e->wb = nil;
 		e->io = nil;
-	}else
+	}else{
 		e->files = nil;
+		e->lastfile = nil;
+		e->hash = nil;
+		e->nfiles = 0;
+		e->wgen = 0;
+	}
 	e->parent = parent;
 	e->dnext = nil;
+	e->dprev = nil;
+	e->hnext = nil;
 	e->excl = nil;
+	e->stat = nil;
+	e->statgen = 0;
+	lock(&memlock);
+	mem.entries++;
+	unlock(&memlock);
 
 	if(parent != nil){
 		parent->qid.vers++;
 		parent->mtime = e->mtime;		/* TO DO: flush parent version? */
+		parent->statgen++;
 
-		/* it would be easier to put new files at the front, but that confuses directory reading */
 		incref(e);
-		for(lp = &parent->files; *lp != nil; lp = &(*lp)->dnext)
-			{}
-		*lp = e;
+		dirlink(parent, e);
 	}
 
 	return e;
@@ -773,8 +1742,21 @@ putentry(Entry *e)
 		putstring(e->uid);
 		putstring(e->gid);
 		putstring(e->muid);
-		free(e->name);
-		free(e);
+		statfree(e->stat);
+		if(e->mode & DMDIR){
+			if(e->hash != nil){
+				free(e->hash->tab);
+				free(e->hash);
+			}
+		}else{
+			extentsfree(e);
+			inlineset(e, nil, 0);
+		}
+		putstring(e->name);
+		slabfree(&entryslab, e);
+		lock(&memlock);
+		mem.entries--;
+		unlock(&memlock);
 	}
 }
 
@@ -786,22 +1768,225 @@ truncatefile(Entry *f)
 	f->mtime = NOW;
 	f->cvers++;
 	f->qid.vers++;
+	f->statgen++;
+	behinddiscard(f);
+	inlineset(f, nil, 0);
 	f->length = 0;
 	for(int i = 0; i < f->nd; i++)
 		freedisk(disk, f->data[i]);
+	extentsfree(f);
+}
+
+/*
+ * replace a small file's contents, of f->length bytes, with d[0..n), which passes to f
+ */
+void
+inlineset(Entry *f, uchar *d, usize n)
+{
+	long o;
+
+	o = f->idata != nil? f->length: 0;
+	free(f->idata);
+	f->idata = d;
+	if(d == nil)
+		n = 0;
+	lock(&memlock);
+	mem.inlinebytes += n-o;
+	unlock(&memlock);
+}
+
+/*
+ * extent lists and their index of file offsets are allocated to size,
+ * doubling as a file grows
+ */
+void
+addextent(Entry *f, Extent ext, u64int start)
+{
+	Extent *d;
+	u64int eoff;
+	uint n;
+	int j;
+
+	if(f->nd >= Nextent)
+		raise(Efilesize);
+	j = findextent(f, start, &eoff);
+	if(!inhole(f, j, start))
+		raise(Ephase);
+	if(f->nd == f->nalloc){
+		n = f->nalloc == 0? 1: 2*f->nalloc;
+		if(n > Nextent)
+			n = Nextent;
+		d = emallocz(n*(sizeof(*d)+sizeof(*f->start)+sizeof(*f->order)), 0);
+		memmove(d, f->data, f->nd*sizeof(*d));
+		memmove(d+n, f->start, f->nd*sizeof(*f->start));
+		memmove((FileOffset*)(d+n)+n, f->order, f->nd*sizeof(*f->order));
+		free(f->data);
+		f->data = d;
+		f->start = (FileOffset*)(d+n);
+		f->order = (u16int*)(f->start+n);
+		lock(&memlock);
+		mem.extents += n-f->nalloc;
+		unlock(&memlock);
+		f->nalloc = n;
+	}
+	memmove(f->order+j+1, f->order+j, (f->nd-j)*sizeof(*f->order));
+	f->order[j] = f->nd;
+	f->start[f->nd] = start;
+	f->data[f->nd++] = ext;
+}
+
+/*
+ * file offset just past the j'th extent in file order.
+ * an extent that filled a hole has whole sectors, so it can
+ * reach past the start of the next, which has those bytes.
+ */
+static u64int
+extentend(Entry *f, int j)
+{
+	u64int end;
+	int i;
+
+	i = f->order[j];
+	end = f->start[i] + f->data[i].length;
+	if(j+1 < f->nd && end > f->start[f->order[j+1]])
+		end = f->start[f->order[j+1]];
+	return end;
+}
+
+/*
+ * bytes covered by f's extents, and the holes between them
+ */
+static u64int
+extentsend(Entry *f)
+{
+	if(f->nd == 0)
+		return 0;
+	return extentend(f, f->nd-1);
+}
+
+/*
+ * position in file order of the extent holding offset, and the offset within it;
+ * if offset is in a hole, the position of the next extent (f->nd past the last),
+ * with *eoff 0
+ */
+static int
+findextent(Entry *f, u64int offset, u64int *eoff)
+{
+	int lo, hi, m;
+
+	lo = 0;
+	hi = f->nd;
+	while(lo < hi){
+		m = (lo+hi)/2;
+		if(offset < extentend(f, m))
+			hi = m;
+		else
+			lo = m+1;
+	}
+	*eoff = 0;
+	if(!inhole(f, lo, offset))
+		*eoff = offset - f->start[f->order[lo]];
+	return lo;
+}
+
+/*
+ * whether offset, at position j from findextent, is in a hole or past the end
+ */
+static int
+inhole(Entry *f, int j, u64int offset)
+{
+	return j == f->nd || offset < f->start[f->order[j]];
+}
+
+static void
+extentsfree(Entry *f)
+{
+	free(f->data);
+	f->data = nil;
+	f->start = nil;
+	f->order = nil;
+	lock(&memlock);
+	mem.extents -= f->nalloc;
+	unlock(&memlock);
+	f->nalloc = 0;
 	f->nd = 0;
 }
 
+/*
+ * metadata memory in use, to see what the name space costs
+ */
+char*
+nubmemstats(void)
+{
+	Fmt fmt;
+	vlong entries, extents, statbufs, inlinebytes, dirty, bytes;
+
+	lock(&memlock);
+	entries = mem.entries;
+	extents = mem.extents;
+	statbufs = mem.statbufs;
+	inlinebytes = mem.inlinebytes;
+	unlock(&memlock);
+	lock(&behind);
+	dirty = behind.bytes;
+	unlock(&behind);
+	bytes = entries*sizeof(Entry) + extents*(sizeof(Extent)+sizeof(FileOffset)+sizeof(u16int)) + statbufs*sizeof(Statbuf);
+	fmtstrinit(&fmt);
+	fmtprint(&fmt, "entries %lld\n", entries);
+	fmtprint(&fmt, "entrysize %d\n", (int)sizeof(Entry));
+	fmtprint(&fmt, "extents %lld\n", extents);
+	fmtprint(&fmt, "statbufs %lld\n", statbufs);
+	fmtprint(&fmt, "inlinebytes %lld\n", inlinebytes);
+	fmtprint(&fmt, "writebehind %lld\n", dirty);
+	fmtprint(&fmt, "bytes %lld\n", bytes);
+	if(entries != 0)
+		fmtprint(&fmt, "bytesperentry %lld\n", bytes/entries);
+	fmtprint(&fmt, "(names, stat bytes and directory indexes not counted)\n");
+	diskcachestats(disk, &fmt);
+	slabstats(&fmt);
+	return fmtstrflush(&fmt);
+}
+
+/*
+ * a sweep copies the log using copyentry, which reads entries
+ * without their locks. so an entry is changed, and the change logged,
+ * between beginchange and endchange, which hold sweeplk shared,
+ * and a sweep holds it exclusively. it comes before any Entry lock.
+ * appends only ask for a sweep; endchange makes it.
+ */
+void
+beginchange(void)
+{
+	rlock(&sweeplk);
+}
+
+void
+endchange(void)
+{
+	runlock(&sweeplk);
+	if(!logwantsweep(thelog))
+		return;
+	wlock(&sweeplk);
+	if(waserror())
+		fprint(2, "nubfs: sweep: %r\n");
+	else{
+		logsweepwanted(thelog);
+		poperror();
+	}
+	wunlock(&sweeplk);
+}
+
 /*
  * log entries
  */
-static void
+static u64int
 nublog(LogEntry l, void *a, usize n)
 {
-	l.seq = nextcmdseq();
-	if(debug['l'])
-		print("%L\n", &l);
 	USED(a);		/* TO DO: send data to replicas */
 	USED(n);
-	logappend(thelog, &l);
+	logappend(thelog, &l);	/* assigns l.seq */
+	trace(Trlog, l.op, 0, 0, l.path, n, 0, l.seq);
+	if(debug['l'])
+		print("%L\n", &l);
+	return l.seq;
 }
@@ -0,0 +1,115 @@
+/*
+ * nubtrace: decode records read from nubfs's trace file
+ */
+
+#include "dat.h"
+
+static char *tnames[] = {
+[Tversion]	"Tversion",
+[Tauth]	"Tauth",
+[Tattach]	"Tattach",
+[Tflush]	"Tflush",
+[Twalk]	"Twalk",
+[Topen]	"Topen",
+[Tcreate]	"Tcreate",
+[Tread]	"Tread",
+[Twrite]	"Twrite",
+[Tclunk]	"Tclunk",
+[Tremove]	"Tremove",
+[Tstat]	"Tstat",
+[Twstat]	"Twstat",
+};
+
+static u64int	last;	/* a reader that falls behind sees a gap */
+static vlong	t0;
+
+static void
+usage(void)
+{
+	fprint(2, "usage: nubtrace [file ...]\n");
+	exits("usage");
+}
+
+static void
+decode(uchar *p)
+{
+	u64int n, path, seq;
+	vlong time;
+	u32int fid, bytes, dur;
+	int tag, op, kind;
+	char *name, buf[16];
+
+	n = GBIT64(p);
+	time = GBIT64(p+8);
+	path = GBIT64(p+16);
+	seq = GBIT64(p+24);
+	fid = GBIT32(p+32);
+	bytes = GBIT32(p+36);
+	dur = GBIT32(p+40);
+	tag = GBIT16(p+44);
+	op = p[46];
+	kind = p[47];
+	if(last != 0 && n > last+1)
+		print("# %llud records lost\n", n-last-1);
+	last = n;
+	if(t0 == 0)
+		t0 = time;
+	switch(kind){
+	case Trreq:
+	case Trerr:
+		if(op < nelem(tnames) && tnames[op] != nil)
+			name = tnames[op];
+		else{
+			snprint(buf, sizeof(buf), "T%d", op);
+			name = buf;
+		}
+		print("%llud %lld.%06lld %s tag %d fid %ud path %llud n %ud %udµs%s\n",
+			n, (time-t0)/1000000000, (time-t0)%1000000000/1000,
+			name, tag, fid, path, bytes, dur, kind == Trerr? " error": "");
+		break;
+	case Trlog:
+		print("%llud %lld.%06lld log %c path %llud n %ud seq %llud\n",
+			n, (time-t0)/1000000000, (time-t0)%1000000000/1000,
+			op, path, bytes, seq);
+		break;
+	default:
+		print("%llud unknown kind %#ux\n", n, kind);
+		break;
+	}
+}
+
+static void
+nubtrace(int fd, char *name)
+{
+	uchar buf[Tracesize];
+	long n;
+
+	while((n = readn(fd, buf, sizeof(buf))) == sizeof(buf))
+		decode(buf);
+	if(n < 0)
+		sysfatal("read %s: %r", name);
+	if(n != 0)
+		fprint(2, "nubtrace: %s: partial record\n", name);
+}
+
+void
+main(int argc, char **argv)
+{
+	int fd, i;
+
+	ARGBEGIN{
+	default:
+		usage();
+	}ARGEND
+
+	if(argc == 0)
+		nubtrace(0, "stdin");
+	for(i = 0; i < argc; i++){
+		fd = open(argv[i], OREAD);
+		if(fd < 0)
+			sysfatal("can't open %s: %r", argv[i]);
+		nubtrace(fd, argv[i]);
+		close(fd);
+	}
+	exits(nil);
+}
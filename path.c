@@ -10,11 +10,17 @@
 
 static Entry*	paths[127];
 static u32int	pathgen;
+static Lock	pathlock;
 
 u32int
 nextpath(void)
 {
-	return ++pathgen;
+	u32int p;
+
+	lock(&pathlock);
+	p = ++pathgen;
+	unlock(&pathlock);
+	return p;
 }
 
 void
@@ -29,9 +35,11 @@ putpath(Entry *e)
 {
 	Entry **hp;
 
+	lock(&pathlock);
 	hp = &paths[e->qid.path%nelem(paths)];
 	e->pnext = *hp;
 	*hp = e;
+	unlock(&pathlock);
 }
 
 Entry*
@@ -39,13 +47,15 @@ lookpath(u32int path, int del)
 {
 	Entry *e, **hp;
 
+	lock(&pathlock);
 	hp = &paths[path%nelem(paths)];
 	for(; (e = *hp) != nil; hp = &e->pnext){
 		if(e->qid.path == path){
 			if(del)
 				*hp = e->pnext;
-			return e;
+			break;
 		}
 	}
-	return nil;
+	unlock(&pathlock);
+	return e;
 }
@@ -0,0 +1,235 @@
+#include	"dat.h"
+#include	"fns.h"
+
+/*
+ * read-ahead
+ *
+ * a fid that reads a file sequentially has the data beyond its last
+ * read fetched in the background, by a few procs, into a buffer of its own.
+ * the window doubles while the reads stay sequential, up to Maxahead,
+ * and collapses when one does not. the buffer is used only while
+ * the file's qid.vers is what it was when the data was read.
+ * everything here is guarded by the file's Entry lock, except that
+ * a fetch reads the disk without it, into the buffer beyond ra->n.
+ */
+
+enum{
+	Minahead=	16*1024,
+	Maxahead=	512*1024,
+	Maxbufs=	32*1024*1024,	/* in all fids' buffers */
+	Nprefetch=	2,
+	Nqueue=	16,	/* fetches waiting; more are dropped */
+};
+
+struct Readahead {
+	int	busy;	/* a fetch is queued or running */
+	usize	win;	/* bytes to keep ahead */
+	u64int	want;	/* fetch from here ... */
+	usize	nwant;	/* ... this much */
+	uchar*	buf;
+	usize	size;	/* of buf */
+	u64int	off;	/* file offset of buf[0] */
+	usize	n;	/* valid bytes in buf */
+	u32int	vers;	/* of the file when read */
+};
+
+typedef struct Fetch Fetch;
+struct Fetch {
+	Fid*	f;	/* both referenced */
+	Entry*	e;
+};
+
+static Channel*	fetchc;
+
+static struct {
+	Lock;
+	usize	bytes;
+} bufs;
+
+static void
+fetch(Fid *f, Entry *e)
+{
+	Readahead *ra;
+	uchar *b;
+	usize keep, n, got;
+	Diskvec v[Nvec];
+	int nv;
+
+	beginchange();	/* behindflush might log */
+	qlock(e);
+	ra = f->ra;
+	if(waserror()){
+		ra->n = 0;
+		ra->busy = 0;
+		qunlock(e);
+		endchange();
+		return;
+	}
+	if(f->open < 0 || e->io != nil || e->idata != nil || ra->want >= e->length){
+		ra->busy = 0;
+		poperror();
+		qunlock(e);
+		endchange();
+		return;
+	}
+	behindflush(e);	/* before the version is noted */
+	n = ra->nwant;
+	if(ra->want+n > e->length)
+		n = e->length - ra->want;
+	if(ra->size < n){
+		lock(&bufs);
+		if(bufs.bytes+(n-ra->size) > Maxbufs)
+			n = ra->size;	/* make do with the buffer it has */
+		else
+			bufs.bytes += n-ra->size;
+		unlock(&bufs);
+	}
+
+	/* keep what is still ahead of the reader */
+	keep = 0;
+	if(ra->n != 0 && ra->vers == e->qid.vers && ra->off <= ra->want && ra->want < ra->off+ra->n)
+		keep = ra->off+ra->n - ra->want;
+	if(keep > n)
+		keep = n;
+	if(ra->size < n){
+		b = emallocz(n, 0);
+		if(keep != 0)
+			memmove(b, ra->buf+(ra->want-ra->off), keep);
+		free(ra->buf);
+		ra->buf = b;
+		ra->size = n;
+	}else if(keep != 0)
+		memmove(ra->buf, ra->buf+(ra->want-ra->off), keep);
+	ra->off = ra->want;
+	ra->n = keep;	/* readahead can use that meanwhile */
+	ra->vers = e->qid.vers;
+	nv = extentvec(e, ra->buf+keep, n-keep, ra->want+keep, v, nelem(v), &got);
+	poperror();
+	qunlock(e);
+	endchange();
+
+	/* if the file changes meanwhile, its version won't match */
+	if(waserror())
+		got = 0;
+	else{
+		nubreadv(v, nv);
+		poperror();
+	}
+	qlock(e);
+	ra->n = keep+got;
+	ra->busy = 0;
+	qunlock(e);
+}
+
+static void
+prefetchproc(void*)
+{
+	Fetch *x;
+
+	threadsetname("nubfs prefetch");
+	for(;;){
+		x = recvp(fetchc);
+		fetch(x->f, x->e);
+		putentry(x->e);
+		putfid(x->f);
+		free(x);
+	}
+}
+
+void
+prefetchinit(int nproc)
+{
+	int i;
+
+	if(nproc <= 0)
+		nproc = Nprefetch;
+	fetchc = chancreate(sizeof(Fetch*), Nqueue);
+	for(i = 0; i < nproc; i++)
+		if(proccreate(prefetchproc, nil, 16*1024) < 0)
+			error("can't create prefetch proc: %r");
+}
+
+/*
+ * copy what the buffer holds of count bytes at offset to a;
+ * f's entry is locked and the range is within the file
+ */
+usize
+readahead(Fid *f, uchar *a, usize count, u64int offset)
+{
+	Readahead *ra;
+	usize n;
+
+	ra = f->ra;
+	if(ra == nil || ra->n == 0 || ra->vers != f->entry->qid.vers)
+		return 0;
+	if(offset < ra->off || offset >= ra->off+ra->n)
+		return 0;
+	n = ra->off+ra->n - offset;
+	if(n > count)
+		n = count;
+	memmove(a, ra->buf+(offset-ra->off), n);
+	return n;
+}
+
+/*
+ * note a read of n bytes at offset, and if it continues the last,
+ * start fetching beyond it unless enough is already there
+ */
+void
+readaheadnext(Fid *f, u64int offset, usize n)
+{
+	Readahead *ra;
+	Entry *e;
+	Fetch *x;
+	u64int end;
+
+	e = f->entry;
+	end = offset+n;
+	ra = f->ra;
+	if(n == 0 || offset != f->nextoff || offset == 0){
+		f->nextoff = end;
+		if(ra != nil)
+			ra->win = 0;
+		return;
+	}
+	f->nextoff = end;
+	if(fetchc == nil || end >= e->length)
+		return;
+	if(ra == nil)
+		ra = f->ra = emallocz(sizeof(*ra), 1);
+	if(ra->win == 0)
+		ra->win = 2*n < Minahead? Minahead: 2*n;
+	else if(2*ra->win <= Maxahead)
+		ra->win *= 2;
+	if(ra->busy)
+		return;
+	if(ra->n != 0 && ra->vers == e->qid.vers &&
+	   ra->off <= end && ra->off+ra->n >= end+ra->win/2)
+		return;	/* enough ahead */
+	ra->want = end;
+	ra->nwant = ra->win;
+	x = emallocz(sizeof(*x), 0);
+	incref(f);
+	incref(e);
+	x->f = f;
+	x->e = e;
+	ra->busy = 1;
+	if(nbsendp(fetchc, x) == 0){
+		ra->busy = 0;
+		decref(e);
+		decref(f);
+		free(x);
+	}
+}
+
+void
+readaheadfree(Readahead *ra)
+{
+	if(ra == nil)
+		return;
+	lock(&bufs);
+	bufs.bytes -= ra->size;
+	unlock(&bufs);
+	free(ra->buf);
+	free(ra);
+}
@@ -11,11 +11,29 @@
 static Disk*	disk;
 static u64int	cmdseq;
 
+/*
+ * writeback Write entries not yet known to have their data on disk
+ */
+typedef struct Unsure Unsure;
+struct Unsure {
+	u32int	path;
+	u32int	cvers;
+	u64int	base;	/* on disk */
+	u32int	count;
+	u32int	sum;
+	u64int	seq;	/* of the Write */
+	Unsure*	next;	/* earlier */
+};
+static Unsure*	unsure;
+
 static int recreate(LogEntry*);
 static int retrunc(LogEntry*);
 static int reremove(LogEntry*);
 static int rewrite(LogEntry*);
 static int rewstat(LogEntry*);
+static int reinline(LogEntry*);
+static int redatamode(LogEntry*);
+static void unsureover(u64int, u32int);
 
 void
 replayinit(Disk *adisk)
@@ -43,7 +61,7 @@ lookfile(u32int p, char *why)
 	e = lookpath(p, 0);
 	if(e != nil){
 		if(e->mode & DMDIR){
-			error("replay: illegal %s of directory #%#8.8ux [%s]", why, p, e->name);
+			error("replay: illegal %s of directory #%#8.8ux [%s]", why, p, e->name->s);
 			return nil;
 		}
 		return e;
@@ -99,6 +117,22 @@ replayentry(LogEntry *le, uint offset)
 		if(!rewstat(le))
 			badreplay(le);
 		break;
+	case Inline:
+		maxpath(le->path);
+		if(!reinline(le))
+			badreplay(le);
+		break;
+	case Datamode:
+		maxpath(le->path);
+		if(!redatamode(le))
+			badreplay(le);
+		break;
+	case Mark:
+		replaysynced(le->seq);
+		break;
+	case Synced:
+		replaysynced(le->synced.upto);
+		break;
 	case Sync:
 		break;
 	default:
@@ -128,7 +162,7 @@ recreate(LogEntry *le)
 			error("replay: can't mkentry %s", le->create.name);
 	}else{
 		error("replay: create in non-directory: %#8.8ux [%s] of %#8.8ux [%s]",
-			le->path, parent->name, le->create.newpath, le->create.name);
+			le->path, parent->name->s, le->create.newpath, le->create.name);
 	}
 	return 1;
 }
@@ -148,13 +182,14 @@ retrunc(LogEntry *le)
 	putstring(f->muid);
 	f->muid = string(le->trunc.muid);
 	f->cvers = le->trunc.cvers;
+	f->statgen++;
 	return 1;
 }
 
 static void
 badext(Entry *f, int i, char *why)
 {
-	error("inconsistency in extents: file %q path %#llux extent %#ux: %s", f->name, f->qid.path, i, why);
+	error("inconsistency in extents: file %q path %#llux extent %#ux: %s", f->name->s, f->qid.path, i, why);
 }
 
 static int
@@ -178,10 +213,14 @@ rewrite(LogEntry *le)
 		return 0;
 	i = le->write.exind & ~NewExtent;
 	if(le->write.exind & NewExtent){
-		if(i != f->nd)
+		if(i != f->nd || i >= Nextent)
 			badext(f, i, "index");
-		f->data[i] = ext;
-		f->nd++;
+		if(i == 0 && f->idata != nil){
+			/* small file moved to extents */
+			inlineset(f, nil, 0);
+			f->length = 0;
+		}
+		addextent(f, ext, offset - le->write.eoff);
 		ext = allocdiskat(disk, ext.base, ext.length);
 		if(ext.length == 0)
 			badext(f, le->write.exind, "replay allocation");
@@ -193,6 +232,20 @@ rewrite(LogEntry *le)
 	if(f->data[i].base != ext.base ||
 	   f->data[i].length != ext.length)
 		badext(f, le->write.exind, "value");
+	unsureover(ext.base + le->write.eoff, count);
+	if(le->write.sum != 0){
+		Unsure *u;
+
+		u = emallocz(sizeof(*u), 0);
+		u->path = le->path;
+		u->cvers = le->write.cvers;
+		u->base = ext.base + le->write.eoff;
+		u->count = count;
+		u->sum = le->write.sum;
+		u->seq = le->seq;
+		u->next = unsure;
+		unsure = u;
+	}
 	length = offset+count;
 	if(length > f->length)
 		f->length = length;
@@ -200,39 +253,143 @@ rewrite(LogEntry *le)
 	putstring(f->muid);
 	f->muid = string(le->write.muid);
 	f->qid.vers++;
+	f->statgen++;
+	return 1;
+}
+
+static int
+reinline(LogEntry *le)
+{
+	Entry *f;
+	uchar *d;
+
+	f = lookfile(le->path, "inline");
+	if(f == nil)
+		return 0;
+	if(f->cvers != le->inl.cvers)
+		return 0;
+	if(f->nd != 0)
+		error("replay: inline data for file %q path %#llux with extents", f->name->s, f->qid.path);
+	d = emallocz(le->inl.length, 0);
+	memmove(d, le->inl.data, le->inl.length);
+	inlineset(f, d, le->inl.length);
+	f->length = le->inl.length;
+	f->iseq = le->seq;
+	f->mtime = le->inl.mtime;
+	putstring(f->muid);
+	f->muid = string(le->inl.muid);
+	f->qid.vers++;
+	f->statgen++;
 	return 1;
 }
 
+static int
+redatamode(LogEntry *le)
+{
+	Entry *d;
+
+	d = lookpath(le->path, 0);
+	if(d == nil || (d->mode & DMDIR) == 0)
+		return 0;
+	d->dmode = le->datamode.mode;
+	return 1;
+}
+
+/*
+ * data for the writeback entries up to seq upto is known to be on disk
+ */
+void
+replaysynced(u64int upto)
+{
+	Unsure *u, **l;
+
+	for(l = &unsure; (u = *l) != nil;){
+		if(u->seq <= upto){
+			*l = u->next;
+			free(u);
+		}else
+			l = &u->next;
+	}
+}
+
+/*
+ * a write of count bytes at disk offset base, in either mode, decides
+ * what should be there: earlier unverified writes to any of it no longer
+ * describe the disk. (their other bytes go unchecked.)
+ */
+static void
+unsureover(u64int base, u32int count)
+{
+	Unsure *u, **l;
+
+	for(l = &unsure; (u = *l) != nil;){
+		if(u->base < base+count && base < u->base+u->count){
+			*l = u->next;
+			free(u);
+		}else
+			l = &u->next;
+	}
+}
+
+/*
+ * after replay, check the data of writeback entries made since
+ * the last Mark or Synced. data that doesn't match what was written
+ * never reached the disk, and might be anything, including another
+ * file's old contents, so it is zeroed.
+ * only the latest write to any disk range is still listed.
+ */
+void
+replaycheck(void)
+{
+	Unsure *u;
+	Entry *f;
+	uchar *buf;
+
+	for(u = unsure; u != nil; u = u->next){
+		f = lookpath(u->path, 0);
+		if(f == nil || f->cvers != u->cvers)
+			continue;	/* gone, or truncated: space is no longer its */
+		buf = emallocz(u->count, 0);
+		diskread(disk, buf, u->count, u->base);
+		if(datasum(buf, u->count) != u->sum){
+			fprint(2, "nubfs: replay: %q: %ud bytes at disk offset %llud were not written; zeroed\n",
+				f->name->s, u->count, u->base);
+			diskzero(disk, u->count, u->base);
+		}
+		free(buf);
+	}
+	replaysynced(~(u64int)0);
+}
+
 static int
 reremove(LogEntry *le)
 {
-	Entry *e, *p, **l;
+	Entry *e, *p;
 
 	e = lookpath(le->path, 1);
 	if(e == nil)
 		return 0;
 	if((p = e->parent) == nil)
-		error("replay: parentless entry %8.8ux [%s]", le->path, e->name);
+		error("replay: parentless entry %8.8ux [%s]", le->path, e->name->s);
 	if(p->mode & DMDIR){
 		if((e->mode & DMDIR) == 0)
 			truncatefile(e);
 		else if(e->files != nil)
-			error("replay: remove non-empty directory %8.8ux [%s]", le->path, e->name);
-		for(l = &p->files; *l != nil && *l != e; l = &(*l)->dnext){
-			/* skip */
-		}
-		if(*l != nil){
-			*l = e->dnext;
+			error("replay: remove non-empty directory %8.8ux [%s]", le->path, e->name->s);
+		if(e->dprev != nil || p->files == e){
+			dirunlink(e);
 			if(e->ref != 1)
-				error("replay: entry %#8.8ux [%q] still in use (%ld)", le->path, e->name, e->ref);
+				error("replay: entry %#8.8ux [%q] still in use (%ld)", le->path, e->name->s, e->ref);
 			putentry(e);
 		}else
-			error("replay: lost entry %8.8ux [%s] in %8.8llux [%s]", le->path, e->name, p->qid.path, p->name);
+			error("replay: lost entry %8.8ux [%s] in %8.8llux [%s]", le->path, e->name->s, p->qid.path, p->name->s);
 		p->mtime = le->remove.mtime;
+		p->qid.vers++;
 		putstring(p->muid);
 		p->muid = string(le->remove.muid);
+		p->statgen++;
 	}else
-		error("replay: remove entry %8.8ux [%s] from file %8.8llux [%s]", le->path, e->name, p->qid.path, p->name);
+		error("replay: remove entry %8.8ux [%s] from file %8.8llux [%s]", le->path, e->name->s, p->qid.path, p->name->s);
 	return 1;
 }
 
@@ -246,6 +403,10 @@ rewstat(LogEntry *le)
 		return 0;
 	if(le->wstat.perm != ~0)
 		f->mode = (f->mode & DMDIR) | (le->wstat.perm &~ DMDIR);
+	if(f->mode & DMDIR)
+		walkstale(f);
+	if(le->wstat.name != nil && *le->wstat.name != 0 && strcmp(le->wstat.name, f->name->s) != 0)
+		dirrename(f, le->wstat.name);
 	if(*le->wstat.uid != 0){
 		putstring(f->uid);
 		f->uid = string(le->wstat.uid);
@@ -262,11 +423,15 @@ rewstat(LogEntry *le)
 		f->mtime = le->wstat.mtime;
 	if(le->wstat.atime != ~0)
 		f->atime = le->wstat.atime;
+	f->statgen++;
 	return 1;
 }
 
 /*
- * copy log entry, discarding if redundant
+ * copy log entry, discarding if redundant.
+ * called during a sweep with the log locked, so it must not
+ * take Entry locks (they are held by callers of logappend);
+ * the sweep keeps changes out instead (see beginchange).
  */
 
 static void
@@ -310,8 +475,8 @@ copyentry(LogEntry *le)
 			}
 		}
 		/* update log entry with current name etc., allowing subsequent Wstats to be removed */
-		if(strcmp(le->create.name, f->name) != 0){
-			le->create.name = f->name;
+		if(strcmp(le->create.name, f->name->s) != 0){
+			le->create.name = f->name->s;
 			repack = 1;
 		}
 		if(le->create.perm != f->mode){
@@ -366,10 +531,28 @@ copyentry(LogEntry *le)
 			break;	/* obsolete extent (all data overwritten) */
 		keep = 1;
 		break;
+	case Inline:
+		f = lookpath(le->path, 0);
+		if(f == nil)
+			break;
+		if(f->cvers != le->inl.cvers || f->idata == nil)
+			break;	/* truncated, or moved to extents */
+		if(le->seq < f->iseq)
+			break;	/* superseded by a later copy of the contents */
+		keep = 1;
+		break;
 	case Wstat:
 		/* always obsolete: Create has been updated from in-memory Entry */
 		break;
+	case Datamode:
+		f = lookpath(le->path, 0);
+		if(f == nil || f->dmode != le->datamode.mode || f->dmode == 0)
+			break;	/* gone, or superseded */
+		keep = 1;
+		break;
 	case Sync:
+	case Mark:
+	case Synced:
 		/* always obsolete */
 		break;
 	default:
@@ -0,0 +1,164 @@
+#include	"dat.h"
+#include	"fns.h"
+
+/*
+ * slabs
+ *
+ * small objects of one size are allocated in chunks, each with its
+ * own free list. chunks with free objects are kept on a list;
+ * a chunk that becomes wholly free is returned to malloc,
+ * unless it is the slab's only spare, so a slab shrinks after a burst.
+ * each object is preceded by a pointer to its chunk.
+ */
+
+enum{
+	Chunkbytes=	16*1024,	/* aim for chunks about this size */
+	Minper=	8,
+};
+
+struct Chunk {
+	Slab*	slab;
+	Chunk*	next;	/* in Slab.partial */
+	Chunk*	prev;
+	void*	free;
+	int	nfree;
+	int	nobj;
+	uvlong	align[];
+};
+
+static struct {
+	Lock;
+	Slab*	slabs;
+} slabs;
+
+static usize
+slotsize(Slab *s)
+{
+	return sizeof(Chunk*) + ((s->size+7)&~7);
+}
+
+static void
+unpartial(Slab *s, Chunk *c)
+{
+	if(c->prev != nil)
+		c->prev->next = c->next;
+	else
+		s->partial = c->next;
+	if(c->next != nil)
+		c->next->prev = c->prev;
+	c->next = c->prev = nil;
+}
+
+static void
+topartial(Slab *s, Chunk *c)
+{
+	c->prev = nil;
+	c->next = s->partial;
+	if(s->partial != nil)
+		s->partial->prev = c;
+	s->partial = c;
+}
+
+/* called with s locked */
+static Chunk*
+newchunk(Slab *s)
+{
+	Chunk *c;
+	uchar *p;
+	usize ss;
+	int i, n;
+
+	if(!s->listed){
+		lock(&slabs);
+		s->link = slabs.slabs;
+		slabs.slabs = s;
+		unlock(&slabs);
+		s->listed = 1;
+	}
+	ss = slotsize(s);
+	n = Chunkbytes/ss;
+	if(n < Minper)
+		n = Minper;
+	s->csize = sizeof(*c)+n*ss;
+	c = emallocz(s->csize, 0);
+	c->slab = s;
+	c->nobj = n;
+	c->nfree = n;
+	c->free = nil;
+	p = (uchar*)c->align;
+	for(i = 0; i < n; i++, p += ss){
+		*(Chunk**)p = c;
+		*(void**)(p+sizeof(Chunk*)) = c->free;
+		c->free = p+sizeof(Chunk*);
+	}
+	s->nchunk++;
+	s->nspare++;
+	topartial(s, c);
+	return c;
+}
+
+void*
+slaballoc(Slab *s, int zero)
+{
+	Chunk *c;
+	void *v;
+
+	lock(s);
+	c = s->partial;
+	if(c == nil)
+		c = newchunk(s);
+	if(c->nfree == c->nobj)
+		s->nspare--;
+	v = c->free;
+	c->free = *(void**)v;
+	if(--c->nfree == 0)
+		unpartial(s, c);
+	s->inuse++;
+	s->nalloc++;
+	unlock(s);
+	if(zero)
+		memset(v, 0, s->size);
+	return v;
+}
+
+void
+slabfree(Slab *s, void *v)
+{
+	Chunk *c;
+
+	if(v == nil)
+		return;
+	c = ((Chunk**)v)[-1];
+	if(c->slab != s)
+		error("slabfree: %s object in %s", c->slab->name, s->name);
+	lock(s);
+	*(void**)v = c->free;
+	c->free = v;
+	if(c->nfree++ == 0)
+		topartial(s, c);
+	s->inuse--;
+	if(c->nfree == c->nobj){
+		if(s->nspare > 0){
+			unpartial(s, c);
+			s->nchunk--;
+			free(c);
+		}else
+			s->nspare++;
+	}
+	unlock(s);
+}
+
+void
+slabstats(Fmt *f)
+{
+	Slab *s;
+
+	lock(&slabs);
+	for(s = slabs.slabs; s != nil; s = s->link){
+		lock(s);
+		fmtprint(f, "slab %s size %lud inuse %lud chunks %lud bytes %lud allocs %llud\n",
+			s->name, (ulong)s->size, s->inuse, s->nchunk, s->nchunk*(ulong)s->csize, s->nalloc);
+		unlock(s);
+	}
+	unlock(&slabs);
+}
@@ -3,9 +3,58 @@
 
 /*
  * strings
+ *
+ * unique, so they can be compared by address.
+ * file names are strings too, so the table grows with the name space.
  */
 
-static String*	strings[127];
+enum{
+	Minstrings=	256,	/* must be power of 2 */
+};
+
+static String**	strings;
+static uint	nhash;	/* size of strings */
+static uint	nstrings;
+static Lock	strlock;
+
+/* most names are short: slabs by size of text, including the zero byte */
+static Slab	strslabs[] = {
+	{.name = "String16", .size = sizeof(String)+16},
+	{.name = "String32", .size = sizeof(String)+32},
+	{.name = "String64", .size = sizeof(String)+64},
+};
+
+static Slab*
+strslab(uint n)
+{
+	Slab *s;
+
+	for(s = strslabs; s < strslabs+nelem(strslabs); s++)
+		if(sizeof(String)+n+1 <= s->size)
+			return s;
+	return nil;
+}
+
+/* called with strlock held */
+static void
+strgrow(void)
+{
+	String **ostrings, *s, *next, **hp;
+	uint i, onhash;
+
+	ostrings = strings;
+	onhash = nhash;
+	nhash = onhash == 0? Minstrings: 2*onhash;
+	strings = emallocz(nhash*sizeof(*strings), 1);
+	for(i = 0; i < onhash; i++)
+		for(s = ostrings[i]; s != nil; s = next){
+			next = s->next;
+			hp = &strings[s->hash&(nhash-1)];
+			s->next = *hp;
+			*hp = s;
+		}
+	free(ostrings);
+}
 
 /* hashpjw from aho & ullman */
 uint
@@ -27,23 +76,33 @@ string(char *c)
 {
 	uint h, n;
 	String *s, **hp;
+	Slab *sl;
 
 	h = hashstr(c);
-	for(hp = &strings[h%nelem(strings)]; (s = *hp) != nil; hp = &s->next){
+	lock(&strlock);
+	if(nstrings >= 2*nhash)
+		strgrow();
+	for(hp = &strings[h&(nhash-1)]; (s = *hp) != nil; hp = &s->next){
 		if(s->hash == h && strcmp(s->s, c) == 0){
 			incref(s);
+			unlock(&strlock);
 			return s;
 		}
 	}
 	n = strlen(c);
-	s = emallocz(sizeof(*s)+n+1, 0);
-	setmalloctag(s, getcallerpc(&c));
+	if((sl = strslab(n)) != nil)
+		s = slaballoc(sl, 0);
+	else
+		s = emallocz(sizeof(*s)+n+1, 0);
 	s->ref = 1;
 	s->n = n;
 	s->hash = h;
+	s->uix = 0;
 	memmove(s->s, c, n+1);
 	s->next = nil;
 	*hp = s;
+	nstrings++;
+	unlock(&strlock);
 	return s;
 }
 
@@ -66,14 +125,23 @@ void
 putstring(String *s)
 {
 	String **hp;
+	Slab *sl;
 
-	if(s != nil && decref(s) == 0){
-		for(hp = &strings[s->hash%nelem(strings)]; *hp != nil; hp = &(*hp)->next){
+	if(s == nil)
+		return;
+	lock(&strlock);	/* string() must not find it once the count reaches zero */
+	if(decref(s) == 0){
+		for(hp = &strings[s->hash&(nhash-1)]; *hp != nil; hp = &(*hp)->next){
 			if(*hp == s){
 				*hp = s->next;
 				break;
 			}
 		}
-		free(s);
+		nstrings--;
+		if((sl = strslab(s->n)) != nil)
+			slabfree(sl, s);
+		else
+			free(s);
 	}
+	unlock(&strlock);
 }
@@ -13,7 +13,7 @@ usage(void)
 }
 
 void
-main(int argc, char **argv)
+threadmain(int argc, char **argv)
 {
 	Extent e[100];
 	u32int size, maxsize, maxalloc;
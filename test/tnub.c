@@ -1,59 +1,1458 @@
 /*
  * test nub
+ *
+ * the file system below 9P, and the 9P server over a pipe,
+ * on scratch disk and log files in /tmp.
+ * failures are printed, and give the exit status.
+ * the tests leave files behind for tnub -r, which replays the log
+ * in a fresh process and checks them.
  */
 
 #include "dat.h"
 #include "fns.h"
 
-void	xstat(Fid*);
+enum{
+	Disksize=	16*1024*1024,
+	Logsize=	4*1024*1024,
+	Stack=	32*1024,
+};
 
-void
-main(int argc, char **argv)
+typedef struct Test Test;
+struct Test {
+	char*	name;
+	void	(*run)(void);
+	void	(*crash)(void);	/* after the commit that follows all runs, if not nil */
+	void	(*check)(void);	/* after replay, if not nil */
+};
+
+int	mainstacksize = 256*1024;	/* tests keep their data on the stack */
+
+static char*	prog;
+static char	diskname[64];
+static char	logname[64];
+static int	diskfd;
+static Disk*	dk;
+static String*	user;
+static Fid*	root;
+static u32int	fidgen;
+static char*	testname;
+static Lock	faillock;
+static int	nfail;
+
+#pragma	varargck	argpos	fail	1
+
+static void
+fail(char *fmt, ...)
+{
+	va_list arg;
+	char buf[256];
+
+	va_start(arg, fmt);
+	vseprint(buf, buf+sizeof(buf), fmt, arg);
+	va_end(arg);
+	lock(&faillock);
+	print("%s: FAIL: %s\n", testname, buf);
+	nfail++;
+	unlock(&faillock);
+}
+
+static void
+pattern(uchar *a, int n, int seed)
+{
+	int i;
+
+	for(i = 0; i < n; i++)
+		a[i] = seed + i*7;
+}
+
+/*
+ * a new fid for path, from the root; nil if the walk fails
+ */
+static Fid*
+walkto(char *path)
 {
-	Fid *root, *d, *f;
-	char *names[10];
-	String *user;
+	char *names[MAXWELEM], *p;
 	Walkqid *wq;
+	Fid *f;
+	int n;
 
-	ARGBEGIN{
-	}ARGEND
+	p = estrdup(path);
+	n = getfields(p, names, nelem(names), 1, "/");
+	f = mkfid(++fidgen, user);
+	if(waserror()){
+		free(p);
+		putfid(f);
+		return nil;
+	}
+	wq = nubwalk(root, f, n, names);
+	poperror();
+	free(p);
+	n -= wq->nqid;
+	putwalkqid(wq);
+	if(n != 0){
+		putfid(f);
+		return nil;
+	}
+	return f;
+}
 
-	quotefmtinstall();
-	nubinit("user");
+static void
+done(Fid *f)
+{
+	nubclunk(f);
+	putfid(f);
+}
+
+static Fid*
+newfile(char *dir, char *name, u32int perm)
+{
+	Fid *f;
+
+	f = walkto(dir);
+	if(f == nil)
+		raise(Enonexist);
+	if(waserror()){
+		putfid(f);
+		raise(nil);
+	}
+	nubcreate(f, name, perm&DMDIR? OREAD: ORDWR, perm);
+	poperror();
+	return f;
+}
+
+static void
+mkfile(char *dir, char *name, uchar *a, long n)
+{
+	Fid *f;
+
+	f = newfile(dir, name, 0666);
+	if(n != 0 && nubwrite(f, a, n, 0) != n)
+		fail("write %s/%s: short", dir, name);
+	done(f);
+}
+
+/*
+ * up to n bytes of the file at path; -1 if it can't be read
+ */
+static long
+readfile(char *path, uchar *a, long n)
+{
+	Fid *f;
+	long m, tot;
+
+	f = walkto(path);
+	if(f == nil)
+		return -1;
 	if(waserror()){
-		print("error: %r\n");
-		exits(nil);
+		done(f);
+		return -1;
 	}
+	nubopen(f, OREAD);
+	for(tot = 0; tot < n; tot += m)
+		if((m = nubread(f, a+tot, n-tot, tot)) == 0)
+			break;
+	poperror();
+	done(f);
+	return tot;
+}
+
+static void
+checkfile(char *path, uchar *a, long n)
+{
+	uchar *b;
+	long m;
+
+	b = emallocz(n+1, 0);
+	m = readfile(path, b, n+1);
+	if(m < 0)
+		fail("%s: can't read", path);
+	else if(m != n)
+		fail("%s: length %ld, want %ld", path, m, n);
+	else if(memcmp(a, b, n) != 0)
+		fail("%s: wrong contents", path);
+	free(b);
+}
+
+static int
+eqwrite(LogEntry *a, LogEntry *b)
+{
+	return a->op == b->op && a->path == b->path && a->seq == b->seq &&
+		a->write.mtime == b->write.mtime && strcmp(a->write.muid, b->write.muid) == 0 &&
+		a->write.offset == b->write.offset && a->write.count == b->write.count &&
+		a->write.vers == b->write.vers && a->write.cvers == b->write.cvers &&
+		a->write.eoff == b->write.eoff && eqextent(a->write.ext, b->write.ext) &&
+		a->write.exind == b->write.exind && a->write.sum == b->write.sum;
+}
+
+/*
+ * pack a Write in the earlier 'w' format, which nothing writes now
+ */
+static int
+packw32(uchar *buf, LogEntry *l)
+{
+	uchar *p;
+	int n;
+
+	p = buf+BIT16SZ;
+	PBIT8(p, Write32);
+	PBIT32(p+1, l->path);
+	PBIT64(p+5, l->seq);
+	p += BIT8SZ+BIT32SZ+BIT64SZ;
+	PBIT32(p, l->write.mtime);
+	PBIT32(p+4, l->write.offset);
+	PBIT32(p+8, l->write.count);
+	PBIT32(p+12, l->write.vers);
+	PBIT32(p+16, l->write.cvers);
+	PBIT32(p+20, l->write.eoff);
+	PBIT64(p+24, l->write.ext.base);
+	PBIT32(p+32, l->write.ext.length);
+	PBIT8(p+36, (l->write.exind & ~NewExtent) | (l->write.exind & NewExtent? NewExtent32: 0));
+	p += 37;
+	n = strlen(l->write.muid)+1;
+	PBIT8(p, n);
+	memmove(p+1, l->write.muid, n);
+	p += 1+n;
+	n = p-buf;
+	PBIT16(buf, n);
+	return n;
+}
+
+/*
+ * Write entries: 'x' without a checksum, as user-019 defined it,
+ * and the earlier 'w', still read as a Write
+ */
+static void
+testwrite(void)
+{
+	LogEntry l, u;
+	uchar buf[256], data[8192];
+	int n;
+
+	l = (LogEntry){Write, 7, {.write={1234, "glenda", 0x123456789ULL, 4096, 3, 2, 512, {0x10000, 8192}, 1|NewExtent, 0}}, 99};
+	n = logpack(buf, sizeof(buf), &l);
+	if(n != BIT16SZ+BIT8SZ+BIT32SZ+BIT64SZ+6*BIT32SZ+2*BIT64SZ+BIT16SZ+1+7)
+		fail("'x' packed in %d bytes", n);
+	if(buf[BIT16SZ] != Write)
+		fail("ordered write packed as %#ux", buf[BIT16SZ]);
+	if(logunpack(buf, n, &u) != n || !eqwrite(&l, &u))
+		fail("'x' unpacked as %L", &u);
+
+	l.write.offset = 70000;
+	n = packw32(buf, &l);
+	if(logunpack(buf, n, &u) != n || !eqwrite(&l, &u))
+		fail("'w' unpacked as %L", &u);
+
+	done(newfile("", "fmt", DMDIR|0777));
+	pattern(data, sizeof(data), 1);
+	mkfile("fmt", "ordered", data, sizeof(data));
+	mkfile("fmt", "w32", nil, 0);
+}
+
+static void
+checkwrite(void)
+{
+	LogEntry l, u;
+	uchar buf[256], data[8192];
+	Extent ext;
+	Entry *e;
+	Fid *f;
+	int n;
+
+	pattern(data, sizeof(data), 1);
+	checkfile("fmt/ordered", data, sizeof(data));
+
+	/* a 'w' entry replayed as if it had been in the log */
+	f = walkto("fmt/w32");
+	if(f == nil){
+		fail("fmt/w32: missing");
+		return;
+	}
+	e = f->entry;
+	ext = allocdisk(dk, 4096);
+	freedisk(dk, ext);
+	pattern(data, 4096, 2);
+	diskwrite(dk, data, 4096, ext.base);
+	l = (LogEntry){Write, e->qid.path, {.write={NOW, "user", 0, 4096, e->qid.vers+1, e->cvers, 0, ext, 0|NewExtent, 0}}, ~(u64int)0>>1};
+	done(f);
+	n = packw32(buf, &l);
+	if(logunpack(buf, n, &u) != n){
+		fail("'w' doesn't unpack");
+		return;
+	}
+	replayentry(&u, 0);
+	checkfile("fmt/w32", data, 4096);
+}
+
+/*
+ * small files kept in 'i' entries, and promoted to extents when they grow
+ */
+static void
+writeat(char *path, uchar *a, long n, u64int off)
+{
+	Fid *f;
+
+	f = walkto(path);
+	if(f == nil)
+		raise(Enonexist);
+	if(waserror()){
+		done(f);
+		raise(nil);
+	}
+	nubopen(f, OWRITE);
+	if(nubwrite(f, a, n, off) != n)
+		fail("write %s: short", path);
+	poperror();
+	done(f);
+}
+
+static void
+isinline(char *path, int want)
+{
+	Fid *f;
+
+	f = walkto(path);
+	if(f == nil){
+		fail("%s: missing", path);
+		return;
+	}
+	if((f->entry->idata != nil) != want)
+		fail("%s: %s inline", path, want? "not": "still");
+	done(f);
+}
+
+static void
+smallfiles(uchar *small, uchar *hole, uchar *grown)
+{
+	pattern(small, 200, 3);
+	memset(hole, 0, 300);
+	pattern(hole, 10, 4);
+	pattern(hole+250, 50, 5);
+	pattern(grown, 600, 6);
+}
+
+static void
+testinline(void)
+{
+	LogEntry l, u;
+	uchar buf[256], small[200], hole[300], grown[600];
+	int n;
+
+	pattern(small, 100, 3);
+	l = (LogEntry){Inline, 9, {.inl={1234, "glenda", 5, 100, small}}, 100};
+	n = logpack(buf, sizeof(buf), &l);
+	if(buf[BIT16SZ] != Inline)
+		fail("inline packed as %#ux", buf[BIT16SZ]);
+	if(logunpack(buf, n, &u) != n || u.op != Inline || u.path != l.path || u.seq != l.seq ||
+	   u.inl.mtime != l.inl.mtime || strcmp(u.inl.muid, l.inl.muid) != 0 ||
+	   u.inl.cvers != l.inl.cvers || u.inl.length != l.inl.length || memcmp(u.inl.data, small, 100) != 0)
+		fail("'i' unpacked as %L", &u);
+
+	smallfiles(small, hole, grown);
+	mkfile("fmt", "small", small, 100);
+	writeat("fmt/small", small+100, 100, 100);
+	isinline("fmt/small", 1);
+	mkfile("fmt", "hole", hole, 10);
+	writeat("fmt/hole", hole+250, 50, 250);
+	isinline("fmt/hole", 1);
+	mkfile("fmt", "grown", grown, 200);
+	isinline("fmt/grown", 1);
+	writeat("fmt/grown", grown+200, 400, 200);
+	isinline("fmt/grown", 0);
+	checkfile("fmt/grown", grown, 600);
+}
+
+static void
+checkinline(void)
+{
+	uchar small[200], hole[300], grown[600];
+
+	smallfiles(small, hole, grown);
+	checkfile("fmt/small", small, 200);
+	isinline("fmt/small", 1);
+	checkfile("fmt/hole", hole, 300);
+	checkfile("fmt/grown", grown, 600);
+	isinline("fmt/grown", 0);
+}
+
+/*
+ * the walk cache must not outlive a rename, remove or wstat
+ * of a directory it passed through
+ */
+static void
+wstatname(char *path, char *name, u32int mode)
+{
+	Dir d;
+	Fid *f;
+
+	f = walkto(path);
+	if(f == nil)
+		raise(Enonexist);
+	if(waserror()){
+		done(f);
+		raise(nil);
+	}
+	nulldir(&d);
+	d.name = name;
+	d.mode = mode;
+	nubwstat(f, &d);
+	poperror();
+	done(f);
+}
+
+static void
+rm(char *path)
+{
+	Fid *f;
+
+	f = walkto(path);
+	if(f == nil)
+		raise(Enonexist);
+	if(waserror()){
+		putfid(f);
+		raise(nil);
+	}
+	nubremove(f);	/* clunks */
+	poperror();
+	putfid(f);
+}
+
+/* walk path twice, the second time from the cache if it's valid */
+static int
+walkqid(char *path, Qid *qid)
+{
+	Fid *f;
+	int i;
+
+	for(i = 0; i < 2; i++){
+		f = walkto(path);
+		if(f == nil)
+			return 0;
+		*qid = f->entry->qid;
+		done(f);
+	}
+	return 1;
+}
+
+static void
+testwalk(void)
+{
+	Qid q, q1;
+
+	done(newfile("", "walk", DMDIR|0777));
+	done(newfile("walk", "a", DMDIR|0777));
+	done(newfile("walk/a", "b", DMDIR|0777));
+	mkfile("walk/a/b", "c", nil, 0);
+	if(!walkqid("walk/a/b/c", &q))
+		fail("walk/a/b/c: can't walk");
+
+	wstatname("walk/a/b", "b2", ~0);
+	if(walkqid("walk/a/b/c", &q1))
+		fail("walk/a/b/c: walked after rename");
+	if(!walkqid("walk/a/b2/c", &q1) || q1.path != q.path)
+		fail("walk/a/b2/c: can't walk after rename");
+
+	wstatname("walk/a/b2/c", "c2", ~0);
+	if(walkqid("walk/a/b2/c", &q1))
+		fail("walk/a/b2/c: walked after renaming c");
+
+	rm("walk/a/b2/c2");
+	if(walkqid("walk/a/b2/c2", &q1))
+		fail("walk/a/b2/c2: walked after remove");
+	mkfile("walk/a/b2", "c2", nil, 0);
+	if(!walkqid("walk/a/b2/c2", &q1) || q1.path == q.path)
+		fail("walk/a/b2/c2: walked to the removed file");
+
+	wstatname("walk/a", nil, DMDIR|0);
+	if(walkqid("walk/a/b2/c2", &q1))
+		fail("walk/a/b2/c2: walked through a directory without permission");
+	wstatname("walk/a", nil, DMDIR|0777);
+	if(!walkqid("walk/a/b2/c2", &q1))
+		fail("walk/a/b2/c2: can't walk after permission restored");
+}
+
+/*
+ * directory reads carry on from the fid's cursor, which must be
+ * given up when the directory changes
+ */
+enum{
+	Ndir=	20,
+	Dirchunk=	150,	/* a few entries per read */
+};
+
+/* read at *off, adding " name" to the list for each entry */
+static long
+readnames(Fid *f, u64int *off, char *list, char *e)
+{
+	uchar buf[Dirchunk];
+	char strs[256];
+	long n, m;
+	Dir d;
+
+	n = nubread(f, buf, sizeof(buf), *off);
+	for(m = 0; m < n; m += BIT16SZ+GBIT16(buf+m)){
+		if(convM2D(buf+m, n-m, &d, strs) == 0){
+			fail("bad directory entry at %llud", *off+m);
+			break;
+		}
+		seprint(list+strlen(list), e, " %s", d.name);
+	}
+	*off += n;
+	return n;
+}
+
+static char*
+fnames(char *list, char *e, int from, int to)
+{
+	*list = 0;
+	for(; from < to; from++)
+		seprint(list+strlen(list), e, " f%02d", from);
+	return list;
+}
+
+static void
+testdir(void)
+{
+	char list[512], want[512], name[16];
+	uchar a[Dirchunk], b[Dirchunk];
+	u64int off;
+	long n;
+	Fid *f;
+	int i, k;
+
+	done(newfile("", "dir", DMDIR|0777));
+	for(i = 0; i < Ndir; i++){
+		snprint(name, sizeof(name), "f%02d", i);
+		mkfile("dir", name, nil, 0);
+	}
+	f = walkto("dir");
+	if(f == nil)
+		raise(Enonexist);
+	if(waserror()){
+		done(f);
+		raise(nil);
+	}
+	nubopen(f, OREAD);
+
+	/* all of it, from the cursor */
+	*list = 0;
+	off = 0;
+	for(i = 0; readnames(f, &off, list, list+sizeof(list)) != 0; i++)
+		;
+	if(i < 3)
+		fail("directory read in %d pieces", i);
+	if(strcmp(list, fnames(want, want+sizeof(want), 0, Ndir)) != 0)
+		fail("read%s", list);
+
+	/* not from the cursor */
+	n = nubread(f, a, sizeof(a), 0);
+	if(n == 0 || nubread(f, b, sizeof(b), 0) != n || memcmp(a, b, n) != 0)
+		fail("reads at offset 0 differ");
+
+	/* the entry at the cursor removed, and another added */
+	*list = 0;
+	off = 0;
+	readnames(f, &off, list, list+sizeof(list));
+	k = 0;
+	for(i = 0; list[i] != 0; i++)
+		if(list[i] == ' ')
+			k++;
+	snprint(name, sizeof(name), "dir/f%02d", k);
+	rm(name);
+	mkfile("dir", "g", nil, 0);
+	*list = 0;
+	while(readnames(f, &off, list, list+sizeof(list)) != 0)
+		;
+	fnames(want, want+sizeof(want), k+1, Ndir);
+	seprint(want+strlen(want), want+sizeof(want), " g");
+	if(strcmp(list, want) != 0)
+		fail("after change, read%s", list);
+	poperror();
+	done(f);
+}
+
+/*
+ * 9P over a pipe, through a connection's fid and tag tables
+ */
+enum{
+	Nfid=	200,	/* enough to grow the fid table twice */
+	Msize=	8192,
+};
+
+static int	clientfd;
+static uchar	msg[Msize];
+
+/* send t, and return the reply's error, or nil */
+static char*
+rpc(Fcall *t, Fcall *r)
+{
+	uint n;
+
+	n = convS2M(t, msg, sizeof(msg));
+	if(n == 0 || write(clientfd, msg, n) != n)
+		error("9p write: %r");
+	n = read9pmsg(clientfd, msg, sizeof(msg));
+	if(n <= 0 || convM2S(msg, n, r) != n)
+		error("9p read: %r");
+	if(r->tag != t->tag)
+		fail("tag %ud answered for %ud", r->tag, t->tag);
+	if(r->type == Rerror)
+		return r->ename;
+	if(r->type != t->type+1)
+		fail("type %d answered for %d", r->type, t->type);
+	return nil;
+}
+
+static char*
+version(char *v, Fcall *r)
+{
+	Fcall t;
+
+	memset(&t, 0, sizeof(t));
+	t.type = Tversion;
+	t.tag = NOTAG;
+	t.msize = Msize;
+	t.version = v;
+	return rpc(&t, r);
+}
+
+static char*
+walk9p(u32int fid, u32int newfid, int n, char **names, Fcall *r)
+{
+	Fcall t;
+
+	memset(&t, 0, sizeof(t));
+	t.type = Twalk;
+	t.tag = 1;
+	t.fid = fid;
+	t.newfid = newfid;
+	t.nwname = n;
+	memmove(t.wname, names, n*sizeof(*names));
+	return rpc(&t, r);
+}
+
+static char*
+clunk9p(u32int fid)
+{
+	Fcall t, r;
+
+	memset(&t, 0, sizeof(t));
+	t.type = Tclunk;
+	t.tag = 1;
+	t.fid = fid;
+	return rpc(&t, &r);
+}
+
+static void
+test9p(void)
+{
+	static char *path[] = {"9p", "f"}, *missing[] = {"9p", "missing"};
+	int p[2], i, n;
+	Fcall t, r;
+	Qid qid;
+
+	done(newfile("", "9p", DMDIR|0777));
+	done(newfile("9p", "f", 0666));
+	if(pipe(p) < 0)
+		error("pipe: %r");
+	srvinit(2);
+	srvconn(p[0], 0);
+	clientfd = p[1];
+	if(waserror()){
+		close(clientfd);
+		raise(nil);
+	}
+
+	if(version("9P1999", &r) != nil || strcmp(r.version, "unknown") != 0)
+		fail("Tversion 9P1999: %s", r.version);
+	if(version("9P2000.u", &r) != nil || strcmp(r.version, "9P2000") != 0 || r.msize > Msize)
+		fail("Tversion 9P2000.u: %s msize %ud", r.version, r.msize);
+	memset(&t, 0, sizeof(t));
+	t.type = Tattach;
+	t.tag = 1;
+	t.fid = 0;
+	t.afid = NOFID;
+	t.uname = "user";
+	t.aname = "";
+	if(rpc(&t, &r) != nil)
+		fail("Tattach: %s", r.ename);
+
+	/* walks, partial walks and clunks */
+	if(walk9p(0, 1, 2, path, &r) != nil || r.nwqid != 2)
+		fail("walk 9p/f: %s", r.type == Rerror? r.ename: "short");
+	else if(!walkqid("9p/f", &qid) || r.wqid[1].path != qid.path)
+		fail("walk 9p/f: wrong qid");
+	if(walk9p(0, 2, 2, missing, &r) != nil || r.nwqid != 1)
+		fail("walk 9p/missing: %s", r.type == Rerror? r.ename: "not partial");
+	if(clunk9p(2) == nil)
+		fail("partial walk made its new fid");
+
+	/* enough fids to grow the table, then removed from the middle of probe sequences */
+	for(i = 0; i < Nfid; i++)
+		if(walk9p(0, 10+i, 0, nil, &r) != nil)
+			fail("clone %d: %s", 10+i, r.ename);
+	for(i = 0; i < Nfid; i += 2)
+		if(clunk9p(10+i) != nil)
+			fail("clunk %d", 10+i);
+	for(i = 1; i < Nfid; i += 2)
+		if(walk9p(10+i, 2, 2, path, &r) != nil || r.nwqid != 2 || clunk9p(2) != nil)
+			fail("fid %d lost", 10+i);
+	for(i = 0; i < Nfid; i++)
+		if((clunk9p(10+i) == nil) != (i&1))
+			fail("fid %d: clunk %s", 10+i, i&1? "failed": "twice");
+
+	/* Tflush of nothing, and of a read in progress: the Rflush comes last */
+	memset(&t, 0, sizeof(t));
+	t.type = Tflush;
+	t.tag = 2;
+	t.oldtag = 3;
+	if(rpc(&t, &r) != nil)
+		fail("Tflush of nothing: %s", r.ename);
+	memset(&t, 0, sizeof(t));
+	t.type = Topen;
+	t.tag = 1;
+	t.fid = 1;
+	t.mode = OREAD;
+	if(rpc(&t, &r) != nil)
+		fail("Topen: %s", r.ename);
+	memset(&t, 0, sizeof(t));
+	t.type = Tread;
+	t.tag = 3;
+	t.fid = 1;
+	t.count = 4096;
+	n = convS2M(&t, msg, sizeof(msg));
+	t.type = Tflush;
+	t.tag = 4;
+	t.oldtag = 3;
+	n += convS2M(&t, msg+n, sizeof(msg)-n);
+	if(write(clientfd, msg, n) != n)
+		error("9p write: %r");
+	for(i = 0; i < 2; i++){
+		n = read9pmsg(clientfd, msg, sizeof(msg));
+		if(n <= 0 || convM2S(msg, n, &r) != n)
+			error("9p read: %r");
+		if(r.tag != (i == 0? 3: 4))
+			fail("reply %d to Tread and Tflush has tag %ud", i, r.tag);
+	}
+
+	/* Tversion clunks everything */
+	if(version("9P2000", &r) != nil)
+		fail("second Tversion: %s", r.ename);
+	if(clunk9p(0) == nil || clunk9p(1) == nil)
+		fail("fids survived Tversion");
+	poperror();
+	close(clientfd);
+}
+
+/*
+ * a directory's name index, built past Dirhashmin entries and
+ * doubled as it grows: lookup after remove and rename, before and after
+ */
+enum{
+	Nsmall=	20,	/* not yet indexed */
+	Nhash=	5*Dirhashmin,	/* indexed, and grown once */
+};
+
+static int	hashremoved[] = {3, 100, 33};
+static int	hashrenamed[] = {5, 40, 7};
+
+/* the name of file i after the first nop removes and renames: nil if removed */
+static char*
+hashname(char *buf, int i, int nop)
+{
+	int j;
+
+	for(j = 0; j < nop; j++){
+		if(hashremoved[j] == i)
+			return nil;
+		if(hashrenamed[j] == i){
+			sprint(buf, "hash/r%03d", i);
+			return buf;
+		}
+	}
+	sprint(buf, "hash/h%03d", i);
+	return buf;
+}
+
+static void
+hashop(int j)
+{
+	char path[32], name[16];
+
+	rm(hashname(path, hashremoved[j], j));
+	hashname(path, hashrenamed[j], j);
+	snprint(name, sizeof(name), "r%03d", hashrenamed[j]);
+	wstatname(path, name, ~0);
+}
+
+static void
+hashcheck(int nfile, int nop, int indexed)
+{
+	char path[32], *p;
+	Fid *f;
+	int i;
+
+	f = walkto("hash");
+	if(f == nil){
+		fail("hash: missing");
+		return;
+	}
+	if((f->entry->hash != nil) != indexed)
+		fail("hash: %d files, %s indexed", f->entry->nfiles, indexed? "not": "still");
+	done(f);
+	for(i = 0; i < nfile; i++){
+		p = hashname(path, i, nop);
+		if(p == nil){
+			sprint(path, "hash/h%03d", i);
+			if((f = walkto(path)) != nil){
+				fail("%s: walked after remove", path);
+				done(f);
+			}
+			continue;
+		}
+		if((f = walkto(p)) == nil)
+			fail("%s: can't walk", p);
+		else
+			done(f);
+		if(p[5] == 'r'){
+			sprint(path, "hash/h%03d", i);
+			if((f = walkto(path)) != nil){
+				fail("%s: walked after rename", path);
+				done(f);
+			}
+		}
+	}
+}
+
+static void
+testhash(void)
+{
+	char name[16];
+	int i;
+
+	done(newfile("", "hash", DMDIR|0777));
+	for(i = 0; i < Nsmall; i++){
+		snprint(name, sizeof(name), "h%03d", i);
+		mkfile("hash", name, nil, 0);
+	}
+	hashop(0);
+	hashcheck(Nsmall, 1, 0);
+	for(; i < Nhash; i++){
+		snprint(name, sizeof(name), "h%03d", i);
+		mkfile("hash", name, nil, 0);
+	}
+	hashcheck(Nhash, 1, 1);
+	for(i = 1; i < nelem(hashremoved); i++)
+		hashop(i);
+	hashcheck(Nhash, nelem(hashremoved), 1);
+}
+
+static void
+checkhash(void)
+{
+	hashcheck(Nhash, nelem(hashremoved), 1);
+}
+
+/*
+ * small appends are gathered by write-behind, not written one by one
+ */
+enum{
+	Nappend=	100,
+	Achunk=	4096,
+};
+
+/* how many of op the latency file has counted */
+static uvlong
+histcount(char *op)
+{
+	char *s, *p, *q, *f[2];
+	uvlong n;
+
+	s = histread();
+	n = 0;
+	for(p = s; p != nil && *p != 0; p = q){
+		q = strchr(p, '\n');
+		if(q != nil)
+			*q++ = 0;
+		if(tokenize(p, f, nelem(f)) == 2 && strcmp(f[0], op) == 0){
+			n = strtoull(f[1], nil, 10);
+			break;
+		}
+	}
+	free(s);
+	return n;
+}
+
+static void
+testbehind(void)
+{
+	uchar *data;
+	uvlong n;
+	Fid *f;
+	int j;
+
+	data = emallocz(Nappend*Achunk, 0);
+	if(waserror()){
+		free(data);
+		raise(nil);
+	}
+	pattern(data, Nappend*Achunk, 20);
+	done(newfile("", "behind", DMDIR|0777));
+	f = newfile("behind", "append", 0666);
+	histreset();
+	if(waserror()){
+		done(f);
+		raise(nil);
+	}
+	for(j = 0; j < Nappend; j++)
+		if(nubwrite(f, data+j*Achunk, Achunk, j*Achunk) != Achunk)
+			fail("append %d: short", j);
+	poperror();
+	done(f);
+	n = histcount("diskwrite");
+	if(n == 0 || n > Nappend/8)
+		fail("%d appends made %llud disk writes", Nappend, n);
+	checkfile("behind/append", data, Nappend*Achunk);
+	poperror();
+	free(data);
+}
+
+static void
+checkbehind(void)
+{
+	uchar *data;
+
+	data = emallocz(Nappend*Achunk, 0);
+	pattern(data, Nappend*Achunk, 20);
+	checkfile("behind/append", data, Nappend*Achunk);
+	free(data);
+}
+
+/*
+ * writes far past the end leave a hole, which later writes can fill
+ */
+enum{
+	Schunk=	4096,
+	Far=	Maxextent+Maxextent/2,	/* more than an extent past the end */
+	Fill=	1024*1024+100,	/* not on a sector */
+	Straddle=	1000,	/* hole bytes before Far in a write that runs on into its extent */
+};
+
+static long
+readat(char *path, uchar *a, long n, u64int off)
+{
+	Fid *f;
+	long m, tot;
+
+	f = walkto(path);
+	if(f == nil)
+		return -1;
+	if(waserror()){
+		done(f);
+		return -1;
+	}
+	nubopen(f, OREAD);
+	for(tot = 0; tot < n; tot += m)
+		if((m = nubread(f, a+tot, n-tot, off+tot)) == 0)
+			break;
+	poperror();
+	done(f);
+	return tot;
+}
+
+static void
+checkat(char *path, uchar *a, long n, u64int off)
+{
+	uchar b[2*Schunk];
+
+	if(readat(path, b, n, off) != n)
+		fail("%s: short read at %llud", path, off);
+	else if(memcmp(a, b, n) != 0)
+		fail("%s: wrong contents at %llud", path, off);
+}
+
+static void
+sparsedata(uchar *head, uchar *far, uchar *fill, uchar *straddle)
+{
+	pattern(head, Schunk, 30);
+	pattern(far, Schunk, 31);
+	pattern(fill, Schunk, 32);
+	pattern(straddle, 2*Straddle, 33);
+}
+
+static void
+checksparse(void)
+{
+	uchar head[Schunk], far[Schunk], fill[Schunk], straddle[2*Straddle], zero[Schunk], b[2*Schunk];
+	Fid *f;
+
+	sparsedata(head, far, fill, straddle);
+	memset(zero, 0, sizeof(zero));
+	f = walkto("sparse/far");
+	if(f == nil){
+		fail("sparse/far: missing");
+		return;
+	}
+	if(f->entry->length != Far+Schunk)
+		fail("sparse/far: length %llud, want %llud", f->entry->length, (u64int)Far+Schunk);
+	done(f);
+	checkat("sparse/far", head, Schunk, 0);
+	checkat("sparse/far", zero, Schunk, Schunk);
+	checkat("sparse/far", zero, Schunk, Maxextent);
+	checkat("sparse/far", fill, Schunk, Fill);
+	checkat("sparse/far", zero, 100, Fill-100);
+	checkat("sparse/far", zero, Schunk, Fill+Schunk);
+	checkat("sparse/far", straddle, 2*Straddle, Far-Straddle);
+	memmove(b, straddle+Straddle, Straddle);
+	memmove(b+Straddle, far+Straddle, Schunk-Straddle);
+	checkat("sparse/far", b, Schunk, Far);
+	if(readat("sparse/far", b, sizeof(b), Far+Schunk/2) != Schunk/2)
+		fail("sparse/far: read past the end");
+}
+
+static void
+testsparse(void)
+{
+	uchar head[Schunk], far[Schunk], fill[Schunk], straddle[2*Straddle];
+
+	sparsedata(head, far, fill, straddle);
+	done(newfile("", "sparse", DMDIR|0777));
+	mkfile("sparse", "far", head, Schunk);
+	writeat("sparse/far", far, Schunk, Far);
+	writeat("sparse/far", fill, Schunk, Fill);
+	writeat("sparse/far", straddle, 2*Straddle, Far-Straddle);
+	checksparse();
+}
+
+/*
+ * the sector cache, left on for the tests that follow:
+ * reads must see overwrites, and blocks freed and reused
+ */
+enum{
+	Cachesize=	256*1024,
+	Cfile=	16*1024,
+};
+
+static uvlong
+cachehits(void)
+{
+	Fmt f;
+	char *s, *p;
+	uvlong n;
+
+	fmtstrinit(&f);
+	diskcachestats(dk, &f);
+	s = fmtstrflush(&f);
+	n = 0;
+	if(s != nil && (p = strstr(s, "hits ")) != nil)
+		n = strtoull(p+5, nil, 10);
+	free(s);
+	return n;
+}
+
+static void
+testcache(void)
+{
+	uchar a[Cfile], b[Cfile];
+	uvlong hits;
+	Extent ext, got;
+	Fid *f;
+
+	diskcache(dk, Cachesize);
+	pattern(a, Cfile, 40);
+	done(newfile("", "cache", DMDIR|0777));
+	mkfile("cache", "a", a, Cfile);
+	checkfile("cache/a", a, Cfile);
+	hits = cachehits();
+	checkfile("cache/a", a, Cfile);
+	if(cachehits() <= hits)
+		fail("second read missed the cache");
+
+	/* overwrite part of a cached sector, and whole ones */
+	pattern(a+1000, 5000, 41);
+	writeat("cache/a", a+1000, 5000, 1000);
+	checkfile("cache/a", a, Cfile);
+
+	/* remove, and reuse its blocks for another file, and then directly */
+	f = walkto("cache/a");
+	if(f == nil)
+		raise(Enonexist);
+	ext = f->entry->data[0];
+	done(f);
+	rm("cache/a");
+	pattern(b, Cfile, 42);
+	mkfile("cache", "b", b, Cfile);
+	checkfile("cache/b", b, Cfile);
+	got = allocdiskat(dk, ext.base, ext.length);
+	if(got.length != 0){
+		diskread(dk, a, Cfile, got.base);	/* cached again */
+		pattern(b, Cfile, 43);
+		diskwrite(dk, b, Cfile, got.base);
+		memset(a, 0, Cfile);
+		diskread(dk, a, Cfile, got.base);
+		if(memcmp(a, b, Cfile) != 0)
+			fail("reused blocks read stale data");
+		freedisk(dk, got);
+	}
+}
+
+/*
+ * read-ahead: a sequential reader, with writes ahead of it
+ * once a fetch has filled the buffer, and while one might be running
+ */
+enum{
+	Pchunk=	8*1024,
+	Npchunk=	64,
+	Settled=	8,	/* chunk read after the fetches have had time */
+	Raced=	20,	/* chunk read with no pause */
+};
+
+static void
+testprefetch(void)
+{
+	uchar *data, buf[Pchunk];
+	Fid *f;
+	int i, j;
+
+	prefetchinit(0);
+	data = emallocz(Npchunk*Pchunk, 0);
+	if(waserror()){
+		free(data);
+		raise(nil);
+	}
+	pattern(data, Npchunk*Pchunk, 50);
+	done(newfile("", "prefetch", DMDIR|0777));
+	mkfile("prefetch", "f", data, Npchunk*Pchunk);
+	f = walkto("prefetch/f");
+	if(f == nil)
+		raise(Enonexist);
+	if(waserror()){
+		done(f);
+		raise(nil);
+	}
+	nubopen(f, OREAD);
+	for(i = 0; i < Npchunk; i++){
+		if(i == Settled || i == Raced){
+			if(i == Settled)
+				sleep(100);
+			for(j = i+1; j < i+4; j++){
+				pattern(data+j*Pchunk+100, Pchunk, 51+j);
+				writeat("prefetch/f", data+j*Pchunk+100, Pchunk, j*Pchunk+100);
+			}
+		}
+		if(nubread(f, buf, Pchunk, i*Pchunk) != Pchunk)
+			fail("chunk %d: short read", i);
+		else if(memcmp(buf, data+i*Pchunk, Pchunk) != 0)
+			fail("chunk %d: stale read-ahead", i);
+	}
+	poperror();
+	done(f);
+	poperror();
+	free(data);
+}
+
+/*
+ * sweeping the log while writer procs write and rename
+ */
+enum{
+	Nwriter=	4,
+	Nchunk=	64,
+	Wchunk=	1024,
+	Renameevery=	16,	/* an even number of renames in all */
+};
+
+static Channel*	writersdone;
+
+static void
+writer(void *v)
+{
+	char path[32], name[16];
+	uchar *data;
+	int i, j;
+
+	i = (uintptr)v;
+	data = emallocz(Nchunk*Wchunk, 0);	/* more than the stack */
+	pattern(data, Nchunk*Wchunk, 10+i);
+	snprint(name, sizeof(name), "w%d", i);
+	if(waserror()){
+		fail("writer %d: %r", i);
+		free(data);
+		sendul(writersdone, 1);
+		return;
+	}
+	mkfile("sweep", name, nil, 0);
+	for(j = 0; j < Nchunk; j++){
+		snprint(path, sizeof(path), "sweep/%s", name);
+		writeat(path, data+j*Wchunk, Wchunk, j*Wchunk);
+		if((j+1)%Renameevery == 0){
+			snprint(name, sizeof(name), "%c%d", name[0] == 'w'? 'v': 'w', i);
+			wstatname(path, name, ~0);
+		}
+	}
+	poperror();
+	free(data);
+	sendul(writersdone, 1);
+}
+
+static void
+checksweep(void)
+{
+	uchar data[Nchunk*Wchunk];
+	char path[32];
+	int i;
+
+	for(i = 0; i < Nwriter; i++){
+		pattern(data, sizeof(data), 10+i);
+		snprint(path, sizeof(path), "sweep/w%d", i);
+		checkfile(path, data, sizeof(data));
+	}
+}
+
+static void
+testsweep(void)
+{
+	int i, n, nsweep;
+
+	done(newfile("", "sweep", DMDIR|0777));
+	writersdone = chancreate(sizeof(ulong), Nwriter);
+	for(i = 0; i < Nwriter; i++)
+		if(proccreate(writer, (void*)(uintptr)i, Stack) < 0)
+			error("tnub: can't create writer: %r");
+	for(n = nsweep = 0; n < Nwriter; nsweep++){
+		nubsweep();
+		sleep(1);
+		while(nbrecvul(writersdone) != 0)
+			n++;
+	}
+	chanfree(writersdone);
+	if(nsweep < 2)
+		fail("only %d sweeps", nsweep);
+	checksweep();
+}
+
+/*
+ * writeback directories: 'd' and 'X' entries, and data that
+ * never reached the disk, which replay must zero
+ */
+static void
+isdatamode(char *path, int mode)
+{
+	Fid *f;
+
+	f = walkto(path);
+	if(f == nil){
+		fail("%s: missing", path);
+		return;
+	}
+	if(f->entry->dmode != mode)
+		fail("%s: data mode %d, want %d", path, f->entry->dmode, mode);
+	done(f);
+}
+
+static void
+testwriteback(void)
+{
+	LogEntry l, u;
+	uchar buf[256], data[4096];
+	int n;
+
+	l = (LogEntry){Datamode, 11, {.datamode={Writeback}}, 101};
+	n = logpack(buf, sizeof(buf), &l);
+	if(buf[BIT16SZ] != Datamode)
+		fail("data mode packed as %#ux", buf[BIT16SZ]);
+	if(logunpack(buf, n, &u) != n || u.op != Datamode || u.path != l.path || u.seq != l.seq ||
+	   u.datamode.mode != Writeback)
+		fail("'d' unpacked as %L", &u);
+
+	l = (LogEntry){Write, 7, {.write={1234, "glenda", 8192, 4096, 3, 2, 0, {0x10000, 8192}, 1, 0xdeadbeef}}, 102};
+	n = logpack(buf, sizeof(buf), &l);
+	if(buf[BIT16SZ] != Writesum)
+		fail("writeback write packed as %#ux", buf[BIT16SZ]);
+	if(logunpack(buf, n, &u) != n || !eqwrite(&l, &u))
+		fail("'X' unpacked as %L", &u);
+
+	done(newfile("", "wb", DMDIR|0777));
+	nubdatamode("wb", Writeback);
+	pattern(data, sizeof(data), 7);
+	mkfile("wb", "good", data, sizeof(data));
+	mkfile("wb", "bad", data, sizeof(data));
+
+	/* overwritten in ordered mode, which decides what is on disk */
+	done(newfile("", "wb2", DMDIR|0777));
+	nubdatamode("wb2", Writeback);
+	mkfile("wb2", "f", data, sizeof(data));
+	nubdatamode("wb2", Ordered);
+	pattern(data, sizeof(data), 8);
+	writeat("wb2/f", data, sizeof(data), 0);
+}
+
+/* wb/bad's data is lost after the commit that logged it */
+static void
+crashwriteback(void)
+{
+	uchar data[4096];
+	Fid *f;
+
+	f = walkto("wb/bad");
+	if(f == nil){
+		fail("wb/bad: missing");
+		return;
+	}
+	memset(data, 0x55, sizeof(data));
+	if(f->entry->nd != 1 || pwrite(diskfd, data, sizeof(data), f->entry->data[0].base) != sizeof(data))
+		fail("wb/bad: can't lose data: %r");
+	done(f);
+}
+
+static void
+checkwriteback(void)
+{
+	uchar data[4096];
+
+	isdatamode("wb", Writeback);
+	isdatamode("wb2", Ordered);
+	pattern(data, sizeof(data), 7);
+	checkfile("wb/good", data, sizeof(data));
+	pattern(data, sizeof(data), 8);
+	checkfile("wb2/f", data, sizeof(data));
+	memset(data, 0, sizeof(data));
+	checkfile("wb/bad", data, sizeof(data));
+}
+
+/*
+ * writeback comes last: a later commit would include the Synced
+ * entry that says its data is on disk
+ */
+static Test tests[] = {
+	{"write", testwrite, nil, checkwrite},
+	{"inline", testinline, nil, checkinline},
+	{"walk", testwalk, nil, nil},
+	{"dir", testdir, nil, nil},
+	{"9p", test9p, nil, nil},
+	{"hash", testhash, nil, checkhash},
+	{"behind", testbehind, nil, checkbehind},
+	{"sparse", testsparse, nil, checksparse},
+	{"cache", testcache, nil, nil},
+	{"prefetch", testprefetch, nil, nil},
+	{"sweep", testsweep, nil, checksweep},
+	{"writeback", testwriteback, crashwriteback, checkwriteback},
+};
+
+static void
+runtest(Test *t, void (*fn)(void))
+{
+	testname = t->name;
+	if(waserror()){
+		fail("%r");
+		return;
+	}
+	fn();
+	poperror();
+}
+
+/*
+ * the file system on the scratch files, replayed
+ */
+static void
+start(int new)
+{
+	int lfd;
+	LogFile *lf;
+
+	if(new){
+		diskfd = create(diskname, ORDWR, 0666);
+		lfd = create(logname, ORDWR, 0666);
+		if(diskfd < 0 || lfd < 0)
+			error("tnub: can't create scratch files: %r");
+		if(pwrite(diskfd, "", 1, Disksize-1) != 1 || pwrite(lfd, "", 1, Logsize-1) != 1)
+			error("tnub: can't size scratch files: %r");
+	}else{
+		diskfd = open(diskname, ORDWR);
+		lfd = open(logname, ORDWR);
+		if(diskfd < 0 || lfd < 0)
+			error("tnub: can't open scratch files: %r");
+	}
+	lf = logopen(lfd, Logsize);
+	dk = diskinit(diskfd, 1024, 0, Disksize);
 	user = string("user");
-	root = mkfid(1, user);
-	nubattach(root, user, "");
-print("root=%#p %#p qid %#llux %#ux\n", root, root->entry, root->entry->qid.path, root->entry->qid.type);
-	d = mkfid(2, user);
-	wq = nubwalk(root, d, 0, nil);
-	if(wq->clone == nil)
-		error("can't clone root");
-print("clone=%#p %#p\n", wq->clone, wq->clone->entry);
-	d = wq->clone;
-	f = nubcreate(d, "f1", OWRITE, 0666);
-	xstat(f);
-	nubwrite(f, "hello, world", 12, 0);
-	xstat(f);
-	nubwrite(f, "goodbye\n", 8, 12);
-	xstat(f);
-	if(f->entry->parent == nil)
-		print("nil parent\n");
-	else
-		print("parent mode %uo\n", f->entry->parent->mode);
-	nubremove(f);
-	exits(nil);
+	nubinit(lf, dk, "user");
+	nubreplay();
+	root = mkfid(++fidgen, user);
+	nubattach(root, "user", "");
+}
+
+/*
+ * check what the tests left, after replay in a fresh process
+ */
+static void
+replay(void)
+{
+	Waitmsg *w;
+
+	testname = "replay";
+	switch(fork()){
+	case -1:
+		fail("fork: %r");
+		return;
+	case 0:
+		execl(prog, prog, "-r", diskname, logname, nil);
+		fprint(2, "tnub: can't exec %s: %r\n", prog);
+		exits("exec");
+	}
+	w = wait();
+	if(w == nil)
+		fail("wait: %r");
+	else if(w->msg[0] != 0)
+		fail("%s", w->msg);
+	free(w);
+}
+
+static void
+usage(void)
+{
+	fprint(2, "usage: tnub [-{debug}] [-r disk log]\n");
+	exits("usage");
 }
 
 void
-xstat(Fid *f)
+threadmain(int argc, char **argv)
 {
-	Dir dir;
+	Test *t;
+	int rflag;
 
-	nubstat(f, &dir);
-	print("stat: name %#q mode %luo length %llud uid %#q gid %#q muid %#q\n",
-		dir.name, dir.mode, dir.length, dir.uid, dir.gid, dir.muid);
+	prog = argv[0];
+	rflag = 0;
+	ARGBEGIN{
+	case 'r':	rflag = 1; break;
+	default:	debug[_argc&0xFF] = 1; break;
+	}ARGEND
+
+	quotefmtinstall();
+	if(rflag){
+		if(argc != 2)
+			usage();
+		snprint(diskname, sizeof(diskname), "%s", argv[0]);
+		snprint(logname, sizeof(logname), "%s", argv[1]);
+		start(0);
+		for(t = tests; t < tests+nelem(tests); t++)
+			if(t->check != nil)
+				runtest(t, t->check);
+		exits(nfail? "fail": nil);
+	}
+	if(argc != 0)
+		usage();
+	snprint(diskname, sizeof(diskname), "/tmp/tnub.%d.disk", getpid());
+	snprint(logname, sizeof(logname), "/tmp/tnub.%d.log", getpid());
+	start(1);
+	for(t = tests; t < tests+nelem(tests); t++)
+		runtest(t, t->run);
+	nubflush();
+	for(t = tests; t < tests+nelem(tests); t++)
+		if(t->crash != nil)
+			runtest(t, t->crash);
+	replay();
+	remove(diskname);
+	remove(logname);
+	if(nfail)
+		print("%d failed\n", nfail);
+	exits(nfail? "fail": nil);
 }
@@ -0,0 +1,140 @@
+#include	"dat.h"
+#include	"fns.h"
+
+/*
+ * trace ring
+ *
+ * a fixed ring of binary records, cheap enough to leave on,
+ * read from the trace file in the ctl tree and decoded by nubtrace.
+ * a record is claimed by number with an atomic increment,
+ * and only its own slot is locked while it is filled.
+ * each record is Tracesize bytes, little-endian:
+ *	n[8]	record number, from 1 (wraps at 2^32 where a long is 32 bits)
+ *	time[8]	nsec when made
+ *	path[8]	qid.path of the file, or 0
+ *	seq[8]	log sequence number, or 0
+ *	fid[4]
+ *	bytes[4]	count read or written, or data logged
+ *	dur[4]	µs from request to reply
+ *	tag[2]
+ *	op[1]	9P T-message type, or log op
+ *	kind[1]	Trreq, Trerr or Trlog
+ */
+
+enum{
+	Ntrace=	8192,	/* must be power of 2 */
+};
+
+typedef struct Trace Trace;
+struct Trace {
+	Lock;	/* held while filled or copied */
+	ulong	n;
+	vlong	time;
+	u64int	path;
+	u64int	seq;
+	u32int	fid;
+	u32int	bytes;
+	u32int	dur;
+	u16int	tag;
+	uchar	op;
+	uchar	kind;
+};
+
+static struct {
+	long	next;	/* records claimed, by ainc */
+	Trace	ring[Ntrace];
+} traces;
+
+int	tracing = 1;
+
+static usize traceio(Fid*, void*, usize, u64int, int);
+
+void
+traceinit(Entry *r, String *user)
+{
+	Entry *tf;
+
+	tf = mkentry(r, "trace", (Qid){4, 0, 0}, 0444, user, user, NOW, 0);
+	tf->io = traceio;
+}
+
+void
+trace(int kind, int op, u32int tag, u32int fid, u64int path, u32int bytes, vlong dur, u64int seq)
+{
+	Trace *t;
+	ulong n;
+
+	if(!tracing)
+		return;
+	n = ainc(&traces.next);
+	t = &traces.ring[n&(Ntrace-1)];
+	lock(t);
+	t->time = nsec();
+	t->path = path;
+	t->seq = seq;
+	t->fid = fid;
+	t->bytes = bytes;
+	t->dur = dur < 0? 0: dur/1000;
+	t->tag = tag;
+	t->op = op;
+	t->kind = kind;
+	t->n = n;
+	unlock(t);
+}
+
+static void
+packtrace(uchar *p, Trace *t)
+{
+	PBIT64(p, t->n);
+	PBIT64(p+8, t->time);
+	PBIT64(p+16, t->path);
+	PBIT64(p+24, t->seq);
+	PBIT32(p+32, t->fid);
+	PBIT32(p+36, t->bytes);
+	PBIT32(p+40, t->dur);
+	PBIT16(p+44, t->tag);
+	p[46] = t->op;
+	p[47] = t->kind;
+}
+
+/*
+ * the trace file is a stream: the offset is ignored, and each fid
+ * reads on from the last record it saw, starting with the oldest
+ * still in the ring. a reader that falls behind skips to the oldest
+ * again, and sees the gap in the record numbers, never a repeat.
+ * a read stops at a record claimed but not yet filled.
+ */
+static usize
+traceio(Fid *f, void *a, usize count, u64int offset, int write)
+{
+	Trace *t;
+	ulong i, next;
+	uchar *p;
+
+	USED(offset);
+	if(write)
+		raise(Eperm);
+	p = a;
+	i = f->traced;
+	while(p+Tracesize <= (uchar*)a+count){
+		next = traces.next;
+		if(next-i > Ntrace)
+			i = next-Ntrace;	/* fallen behind */
+		if(i == next)
+			break;
+		t = &traces.ring[(i+1)&(Ntrace-1)];
+		lock(t);
+		if(t->n != i+1){
+			unlock(t);
+			if((long)(t->n-(i+1)) > 0)
+				continue;	/* overwritten since next was read */
+			break;	/* not yet filled */
+		}
+		packtrace(p, t);
+		unlock(t);
+		p += Tracesize;
+		i++;
+	}
+	f->traced = i;
+	return p-(uchar*)a;
+}
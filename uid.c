@@ -30,11 +30,29 @@ struct Users {
 static struct{
 	RWLock;
 	int	n;
+	ulong	gen;	/* changes with any user or group */
+	int	regroup;	/* groups is out of date */
+	uint	nuix;	/* String.uix given out */
 	Users	byuid;
 	Users	byname;
 } users;
 
+/*
+ * group membership, as bit sets indexed by String.uix, so that
+ * ingroup needs no string compares. rebuilt once for each batch
+ * of changes (a users file, a uname command), under the users lock,
+ * which ingroup holds while it looks.
+ */
+typedef struct Groups Groups;
+struct Groups {
+	uint	nuix;
+	uchar**	mem;	/* mem[group name's uix], nil if not a group */
+};
+
+static Groups*	groups;
+
 static usize usersio(Fid*, void*, usize, u64int, int);
+static void groupsupdate(void);
 
 void
 usersinit(Entry *r, String *user)
@@ -157,7 +175,10 @@ checkname(char *s)
 	}
 }
 
-void
+/*
+ * groupsupdate must follow a batch of adduser and deluser
+ */
+static void
 adduser(char *uid, char *name, char *leader, int nm, char **mem)
 {
 	Ulist **l, *p, *q;
@@ -204,10 +225,12 @@ adduser(char *uid, char *name, char *leader, int nm, char **mem)
 		users.n++;
 	addrefuser(&users.byuid, u->uid, u);
 	addrefuser(&users.byname, u->name, u);
+	users.gen++;
+	users.regroup = 1;
 	wunlock(&users);
 }
 
-int
+static int
 deluser(char *name)
 {
 	User *u;
@@ -220,10 +243,97 @@ deluser(char *name)
 	}
 	delrefuser(&users.byuid, u->uid->s);
 	users.n--;
+	users.gen++;
+	users.regroup = 1;
 	wunlock(&users);
 	return 1;
 }
 
+/*
+ * lets caches of names, groups and permissions tell when they are stale
+ */
+ulong
+usersgen(void)
+{
+	ulong g;
+
+	rlock(&users);
+	g = users.gen;
+	runlock(&users);
+	return g;
+}
+
+static void
+setuix(String *s)
+{
+	if(s->uix == 0)
+		s->uix = ++users.nuix;
+}
+
+static void
+freegroups(Groups *g)
+{
+	uint i;
+
+	if(g == nil)
+		return;
+	for(i = 0; g->mem != nil && i < g->nuix; i++)
+		free(g->mem[i]);
+	free(g->mem);
+	free(g);
+}
+
+/*
+ * rebuild groups after changes to users
+ */
+static void
+groupsupdate(void)
+{
+	Groups *g;
+	Ulist *p;
+	User *u;
+	uchar *m;
+	int i, j;
+
+	wlock(&users);
+	if(!users.regroup){
+		wunlock(&users);
+		return;
+	}
+	g = nil;
+	if(waserror()){
+		freegroups(g);
+		wunlock(&users);
+		raise(nil);
+	}
+	for(i = 0; i < nelem(users.byname.hash); i++)
+		for(p = users.byname.hash[i]; p != nil; p = p->next){
+			u = p->user;
+			setuix(u->name);
+			for(j = 0; j < u->n; j++)
+				setuix(u->mem[j]);
+		}
+	g = emallocz(sizeof(*g), 1);
+	g->nuix = users.nuix+1;
+	g->mem = emallocz(g->nuix*sizeof(*g->mem), 1);
+	for(i = 0; i < nelem(users.byname.hash); i++)
+		for(p = users.byname.hash[i]; p != nil; p = p->next){
+			u = p->user;
+			if(u->n == 0)
+				continue;
+			m = emallocz((g->nuix+7)/8, 1);
+			for(j = 0; j < u->n; j++)
+				m[u->mem[j]->uix>>3] |= 1<<(u->mem[j]->uix&7);
+			g->mem[u->name->uix] = m;
+		}
+	poperror();
+	freegroups(groups);
+	groups = g;
+	users.regroup = 0;
+	users.gen++;	/* caches made from the old groups are stale */
+	wunlock(&users);
+}
+
 static int
 ismember(char *s, int n, String **mem)
 {
@@ -235,25 +345,28 @@ ismember(char *s, int n, String **mem)
 	return 0;
 }
 
+/*
+ * Strings are unique, so uid and gid can be compared by address
+ */
 int
-ingroup(char *uid, char *gid)
+ingroup(String *uid, String *gid)
 {
-	Ulist *p;
-	User *g;
+	Groups *g;
+	uchar *m;
+	int r;
 
-	if(uid == gid || strcmp(uid, gid) == 0)
+	if(uid == gid)
 		return 1;
 	rlock(&users);
-	p = *lookuser(&users.byname, gid);
-	if(p != nil){
-		g = p->user;
-		if(ismember(uid, g->n, g->mem)){
-			runlock(&users);
-			return 1;
-		}
+	g = groups;
+	if(g == nil || uid->uix == 0 || uid->uix >= g->nuix || gid->uix >= g->nuix){
+		runlock(&users);
+		return 0;
 	}
+	m = g->mem[gid->uix];
+	r = m != nil && (m[uid->uix>>3] & (1<<(uid->uix&7))) != 0;
 	runlock(&users);
-	return 0;
+	return r;
 }
 
 int
@@ -334,6 +447,7 @@ userswrite(void *buf, usize n)
 		raise(Enomem);
 	if(waserror()){
 		free(p);
+		groupsupdate();	/* for the lines that were done */
 		raise(nil);
 	}
 	memmove(p, buf, n);
@@ -359,6 +473,7 @@ userswrite(void *buf, usize n)
 	}
 	poperror();
 	free(p);
+	groupsupdate();
 	return n;
 }
 
@@ -373,6 +488,10 @@ unamecmd(int nf, char **flds)
 {
 	int i;
 
+	if(waserror()){
+		groupsupdate();
+		raise(nil);
+	}
 	if(strcmp(flds[0], "-") == 0){
 		for(i = 1; i < nf; i++)
 			deluser(flds[i]);
@@ -382,6 +501,8 @@ unamecmd(int nf, char **flds)
 		adduser(flds[1], flds[0], nil, 0, nil);
 	else if(nf != 0)
 		adduser(flds[0], flds[0], nil, 0, nil);
+	poperror();
+	groupsupdate();
 }
 
 static usize
@@ -390,16 +511,14 @@ usersio(Fid *f, void *a, usize count, u64int offset, int write)
 	char *s;
 	int n;
 
-	USED(f);
 	if(write)
 		return userswrite(a, count);
-	s = usersread();
+	s = fidsnap(f, offset, usersread);
 	n = strlen(s);
 	if(offset > n)
 		offset = n;
 	if(offset+count > n)
 		count = n-offset;
 	memmove(a, s+offset, count);
-	free(s);
 	return count;
 }
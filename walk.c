@@ -0,0 +1,175 @@
+#include	"dat.h"
+#include	"fns.h"
+
+/*
+ * walk cache
+ *
+ * remembers multi-element walks by start, user and names,
+ * with the entries reached. each directory has a generation,
+ * changed whenever a walk through it might go differently:
+ * a name is added, removed or changed, or its own mode or owners change.
+ * a cached walk is used only if no directory it passed through has changed,
+ * nor the users table, nor the permission checking.
+ */
+
+enum{
+	Nwalkcache=	1024,	/* must be power of 2 */
+};
+
+typedef struct Walkent Walkent;
+struct Walkent {
+	Entry*	start;	/* all entries are referenced */
+	String*	user;
+	char*	path;	/* names, separated by / */
+	uint	hash;
+	int	nopermcheck;
+	ulong	usersgen;
+	int	n;
+	Entry*	e[MAXWELEM];
+	ulong	gen[MAXWELEM];	/* of start and e[0..n-2] */
+};
+
+static struct {
+	Lock;
+	ulong	gen;
+	Walkent*	tab[Nwalkcache];
+} walks;
+
+/*
+ * a walk through directory e might now go differently
+ */
+void
+walkstale(Entry *e)
+{
+	lock(&walks);
+	e->wgen = ++walks.gen;
+	unlock(&walks);
+}
+
+static uint
+walkhash(Entry *start, String *user, int n, char **names)
+{
+	uint h;
+	int i;
+
+	h = (uintptr)start ^ (uintptr)user*31;
+	for(i = 0; i < n; i++)
+		h = h*37 + hashstr(names[i]);
+	return h;
+}
+
+static int
+walkmatch(Walkent *w, Entry *start, String *user, int n, char **names)
+{
+	char *p;
+	int i, l;
+
+	if(w->start != start || w->user != user || w->n != n)
+		return 0;
+	p = w->path;
+	for(i = 0; i < n; i++){
+		l = strlen(names[i]);
+		if(strncmp(p, names[i], l) != 0 || p[l] != (i == n-1? 0: '/'))
+			return 0;
+		p += l+1;
+	}
+	return 1;
+}
+
+static void
+walkfree(Walkent *w)
+{
+	int i;
+
+	if(w == nil)
+		return;
+	putentry(w->start);
+	putstring(w->user);
+	for(i = 0; i < w->n; i++)
+		putentry(w->e[i]);
+	free(w->path);
+	free(w);
+}
+
+/*
+ * if the walk is cached and still valid, return its final entry (referenced)
+ * and fill in the qids on the way
+ */
+Entry*
+walklook(Entry *start, String *user, int n, char **names, Qid *qid)
+{
+	Walkent *w, **l;
+	Entry *e;
+	ulong ugen;
+	uint h;
+	int i;
+
+	ugen = usersgen();
+	h = walkhash(start, user, n, names);
+	lock(&walks);
+	l = &walks.tab[h&(Nwalkcache-1)];
+	w = *l;
+	if(w == nil || w->hash != h || !walkmatch(w, start, user, n, names)){
+		unlock(&walks);
+		return nil;
+	}
+	if(w->usersgen != ugen || w->nopermcheck != nopermcheck)
+		goto Stale;
+	if(start->wgen != w->gen[0])
+		goto Stale;
+	for(i = 0; i < n-1; i++)
+		if(w->e[i]->wgen != w->gen[i+1])
+			goto Stale;
+	for(i = 0; i < n; i++)
+		qid[i] = w->e[i]->qid;
+	e = w->e[n-1];
+	incref(e);
+	unlock(&walks);
+	return e;
+
+Stale:
+	*l = nil;
+	unlock(&walks);
+	walkfree(w);
+	return nil;
+}
+
+/*
+ * remember a complete walk; ents are the entries reached,
+ * each referenced, and gen the generations of start and ents[0..n-2]
+ * when they were walked from. the references pass to the cache.
+ */
+void
+walkenter(Entry *start, String *user, int n, char **names, Entry **ents, ulong *gen, ulong ugen)
+{
+	Walkent *w, *ow, **l;
+	char *p;
+	int i, len;
+
+	len = 0;
+	for(i = 0; i < n; i++)
+		len += strlen(names[i])+1;
+	w = emallocz(sizeof(*w), 1);
+	w->path = p = emallocz(len, 0);
+	for(i = 0; i < n; i++){
+		len = strlen(names[i]);
+		memmove(p, names[i], len);
+		p += len;
+		*p++ = i == n-1? 0: '/';
+	}
+	incref(start);
+	w->start = start;
+	w->user = sincref(user);
+	w->hash = walkhash(start, user, n, names);
+	w->nopermcheck = nopermcheck;
+	w->usersgen = ugen;
+	w->n = n;
+	memmove(w->e, ents, n*sizeof(*ents));
+	memmove(w->gen, gen, n*sizeof(*gen));
+	lock(&walks);
+	l = &walks.tab[w->hash&(Nwalkcache-1)];
+	ow = *l;
+	*l = w;
+	unlock(&walks);
+	walkfree(ow);
+}